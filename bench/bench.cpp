@@ -0,0 +1,604 @@
+// NOTE benchmark of the stages of rainbower, build it from the repository root with
+// g++ bench/bench.cpp -O2 -pthread -o rainbower-bench
+//
+// rainbower-bench [-f filetype] [-s size KB] [-n sizes] [-r repeats] [-g generator] [-l languages]
+//                 [-t Y|n] [-p Y|n] [-m mode] [-x slope] [files and directories]...
+//
+// Without paths it parses every synthetic corpus (or only the -g one) at -n sizes doubling from
+// -s, with paths it parses the files found there with the filetype of their extension. The other
+// filetypes are looked up in the -l languages file (rc/languages by default).
+// Every stage is timed on its own (the best of -r runs) and the number of allocations it made is
+// counted. Then the time of each stage is fitted against the input size, a stage whose time grows
+// faster than size^slope (1.25 by default) is flagged and the exit code is 1
+
+// NOTE the system headers of rainbower come first so that only its own calls are counted
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+int bench_allocations;
+
+void *CountMalloc(size_t size)
+{
+    bench_allocations++;
+    return malloc(size);
+}
+
+void *CountRealloc(void *data, size_t size)
+{
+    bench_allocations++;
+    return realloc(data, size);
+}
+
+#define malloc CountMalloc
+#define realloc CountRealloc
+#define main rainbower_main
+#include "../rc/rainbower.cpp"
+#undef main
+#undef malloc
+#undef realloc
+
+#define STAGE_READ 0
+#define STAGE_MASK 1
+#define STAGE_ANGLE 2
+#define STAGE_BRACKETS 3
+#define STAGE_OUTPUT 4
+#define STAGE_FUSED 5
+#define NUM_STAGES 6
+
+const char *stage_names[NUM_STAGES] = {"read", "mask", "angle", "brackets", "output", "fused"};
+
+struct StageTimes
+{
+    bool ran[NUM_STAGES];
+    uint64_t ns[NUM_STAGES];
+    int allocations[NUM_STAGES];
+    size_t bytes;
+};
+
+struct BenchOptions
+{
+    const char *filetype;
+    size_t size;
+    int num_sizes;
+    int repeats;
+    const char *generator;
+    const char *languages_path;
+    char check_templates;
+    char check_pound_ifs;
+    char mode;
+    double max_slope;
+
+    const char **paths;
+    int num_paths;
+};
+
+// NOTE the generators, xorshift so that every run parses the same text
+
+uint32_t Random(uint32_t *seed)
+{
+    uint32_t x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return x;
+}
+
+const char *Pick(uint32_t *seed, const char **strings, int count)
+{
+    return strings[Random(seed) % count];
+}
+
+void AppendIndent(OutputBuffer *out, int depth)
+{
+    for(int i = 0; i < depth && i < 32; ++i)
+    {
+        Append(out, "    ");
+    }
+}
+
+// NOTE nests up to a thousand brackets deep then closes them all
+void GenerateNesting(OutputBuffer *out, size_t size, uint32_t *seed)
+{
+    char stack[1024];
+    const char *opens = "({[";
+    const char *closes = ")}]";
+    while(out->length < size)
+    {
+        int depth = 1 + Random(seed) % 1024;
+        for(int i = 0; i < depth; ++i)
+        {
+            int kind = Random(seed) % 3;
+            stack[i] = closes[kind];
+            AppendIndent(out, i);
+            Append(out, "call_");
+            Append(out, &opens[kind], 1);
+            Append(out, "\n");
+        }
+        for(int i = depth - 1; i >= 0; --i)
+        {
+            AppendIndent(out, i);
+            Append(out, &stack[i], 1);
+            Append(out, ";\n");
+        }
+    }
+}
+
+// NOTE nested templates mixed with comparisons and shifts that leave '<' and '>' unpaired
+void GenerateTemplates(OutputBuffer *out, size_t size, uint32_t *seed)
+{
+    const char *names[] = {"std::vector", "std::map", "Optional", "std::pair", "Span", "Box"};
+    const char *comparisons[] = {"if(i < n && j > m)", "x = a < b ? c : d;", "while(k << 2 < limit)",
+                                 "y = (p > q) == (r < s);", "z = v >> 3 > w;", "mask = 1 << bit;"};
+    while(out->length < size)
+    {
+        int depth = 1 + Random(seed) % 6;
+        for(int i = 0; i < depth; ++i)
+        {
+            Append(out, Pick(seed, names, 6));
+            Append(out, "<int, ");
+        }
+        Append(out, "T");
+        for(int i = 0; i < depth; ++i)
+        {
+            Append(out, ">");
+        }
+        Append(out, " value = make<Foo<T>>(a < b, c);\n    ");
+        Append(out, Pick(seed, comparisons, 6));
+        Append(out, "\ntemplate<typename T, int N = (1 < 2)> struct S { T t[N]; };\n");
+    }
+}
+
+// NOTE a single line, like a minified file
+void GenerateMinified(OutputBuffer *out, size_t size, uint32_t *seed)
+{
+    const char *statements[] = {"int f(int a){return g(a[1],{2,3});}", "x=(y+z)*w[i];", "if(a<b){c=d>e;}",
+                                "s=\"(\";", "v.push_back({1,{2,3}});", "for(int i=0;i<n;++i){t[i]=i;}"};
+    while(out->length < size)
+    {
+        Append(out, Pick(seed, statements, 6));
+    }
+    Append(out, "\n");
+}
+
+// NOTE more comments than code, the comments full of brackets
+void GenerateComments(OutputBuffer *out, size_t size, uint32_t *seed)
+{
+    const char *comments[] = {"// a line comment with (unbalanced [brackets\n", "/* a block ( comment } */\n",
+                              "/*\n * a long block comment\n * with {several} lines (and brackets\n */\n",
+                              "/// doc comment <T> for f(x)\n", "int x = f(1); // trailing ]\n",
+                              "call(/* inline ( */ a, b);\n"};
+    while(out->length < size)
+    {
+        Append(out, Pick(seed, comments, 6));
+    }
+}
+
+// NOTE string and character literals with escapes, brackets and raw strings
+void GenerateStrings(OutputBuffer *out, size_t size, uint32_t *seed)
+{
+    const char *strings[] = {"s = \"text (with [brackets\\\" and escapes\\n\";\n", "c = '(';\n",
+                             "t = R\"x(raw ( string )\" {)x\";\n", "u = \"\\\\\";\n",
+                             "printf(\"%d {%s}\\n\", f(a), \"]\");\n", "w = L\"wide <\" \"concat >\";\n"};
+    while(out->length < size)
+    {
+        Append(out, Pick(seed, strings, 6));
+    }
+}
+
+// NOTE lots of short statements and little nesting
+void GenerateFlat(OutputBuffer *out, size_t size, uint32_t *seed)
+{
+    const char *statements[] = {"value = call(a, b[c]);\n", "total += items[i];\n", "ptr->field = {1, 2};\n",
+                                "result = (x + y) * z;\n", "f();\n", "int array[4];\n"};
+    while(out->length < size)
+    {
+        Append(out, Pick(seed, statements, 6));
+    }
+}
+
+struct Generator
+{
+    const char *name;
+    void (*generate)(OutputBuffer *out, size_t size, uint32_t *seed);
+};
+
+Generator generators[] = {
+    {"nesting", GenerateNesting},
+    {"templates", GenerateTemplates},
+    {"minified", GenerateMinified},
+    {"comments", GenerateComments},
+    {"strings", GenerateStrings},
+    {"flat", GenerateFlat},
+};
+
+#define NUM_GENERATORS (int)(sizeof(generators) / sizeof(generators[0]))
+
+// NOTE the stages
+
+struct PipeWriter
+{
+    int fd;
+    const char *data;
+    size_t length;
+};
+
+void *WritePipe(void *data)
+{
+    PipeWriter *writer = (PipeWriter *)data;
+    WriteAll(writer->fd, writer->data, writer->length);
+    close(writer->fd);
+    return NULL;
+}
+
+void StartStage(StageTimes *times, int stage, uint64_t *start)
+{
+    times->ran[stage] = true;
+    times->allocations[stage] = bench_allocations;
+    *start = GetNanoseconds();
+}
+
+void FinishStage(StageTimes *times, int stage, uint64_t start)
+{
+    times->ns[stage] = GetNanoseconds() - start;
+    times->allocations[stage] = bench_allocations - times->allocations[stage];
+}
+
+// NOTE the same passes as ParseSource for a full parse on one thread, one at a time, the source
+// is read from a pipe like kakoune sends it
+void RunStages(String *input, RainbowOptions *options, ParseState *state, StageTimes *times)
+{
+    *times = {};
+    times->bytes = input->length;
+    uint64_t start;
+
+    int fds[2];
+    if(pipe(fds) != 0)
+    {
+        return;
+    }
+    PipeWriter writer = {fds[1], input->data, input->length};
+    pthread_t thread;
+    pthread_create(&thread, NULL, WritePipe, &writer);
+
+    StartStage(times, STAGE_READ, &start);
+    String source_code = ReadSource(fds[0]);
+    FinishStage(times, STAGE_READ, start);
+
+    pthread_join(thread, NULL);
+    close(fds[0]);
+
+    ResetParseState(state);
+    Arena *arena = &state->arena;
+
+    bool is_c = strcmp(options->filetype, "c") == 0 || strcmp(options->filetype, "cpp") == 0;
+    bool is_rust = strcmp(options->filetype, "rust") == 0;
+    Language *language = FindLanguage(options->languages, options->filetype);
+    const char *buffer = source_code.data;
+
+    IncrementalRun run;
+    if(is_c || is_rust || language)
+    {
+        StartStage(times, STAGE_MASK, &start);
+        state->masked = PushArray(arena, char, source_code.length + 1);
+        state->masked[source_code.length] = 0;
+        StartRun(&run, &state->mask_checkpoints, NULL, NULL, 0, 0);
+        if(is_c)
+        {
+            MaskCFile(&source_code, state->masked, (options->check_pound_ifs == 'Y'), &options->defines, &run, NULL);
+        }
+        else if(is_rust)
+        {
+            MaskRustFile(&source_code, state->masked, &run, NULL);
+        }
+        else
+        {
+            MaskLanguageFile(&source_code, state->masked, language, &run, NULL);
+        }
+        FinishStage(times, STAGE_MASK, start);
+        buffer = state->masked;
+
+        const char *terminators = is_c ? C_TEMPLATE_TERMINATORS : RUST_GENERIC_TERMINATORS;
+        if(language)
+        {
+            terminators = language->generic_terminators[0] ? language->generic_terminators : NULL;
+        }
+        if(options->check_templates == 'Y' && strcmp(options->filetype, "c") != 0 && terminators)
+        {
+            StartStage(times, STAGE_ANGLE, &start);
+            StartRun(&run, &state->angle_checkpoints, NULL, NULL, 0, 0);
+            state->generics = ParseAngleBrackets(state->masked, source_code.length, arena, terminators, &run);
+            FinishStage(times, STAGE_ANGLE, start);
+        }
+    }
+
+    CharPair generic_pair;
+    generic_pair.a = '<';
+    generic_pair.b = '>';
+
+    StartStage(times, STAGE_BRACKETS, &start);
+    StartRun(&run, &state->bracket_checkpoints, NULL, NULL, 0, 0);
+    state->result = ParseGenericFile(buffer, source_code.length, arena, &state->line_starts, state->generics,
+                                     generic_pair, &run);
+    FinishStage(times, STAGE_BRACKETS, start);
+
+    StartStage(times, STAGE_OUTPUT, &start);
+    OutputBuffer out = {};
+    PrintRanges(&out, options, state);
+    FinishStage(times, STAGE_OUTPUT, start);
+
+    // NOTE the mask, <> and bracket passes fused over windows the way ParseSource runs them when
+    // the state is not kept, on a state of its own
+    if(is_c || is_rust || language)
+    {
+        StartStage(times, STAGE_FUSED, &start);
+        ParseState fused = {};
+        ParseSource(&source_code, options, &fused);
+        FinishStage(times, STAGE_FUSED, start);
+        Free(&fused);
+    }
+
+    Free(&out);
+    Free(&source_code);
+}
+
+// NOTE keeps the best time of each stage, the allocations are the same every run
+void RunStagesRepeated(String *input, RainbowOptions *options, int repeats, StageTimes *best)
+{
+    for(int r = 0; r < repeats; ++r)
+    {
+        // NOTE a new state every run, so the arena has to grow like it does the first time
+        ParseState state = {};
+        StageTimes times;
+        RunStages(input, options, &state, &times);
+        Free(&state);
+
+        if(r == 0)
+        {
+            *best = times;
+            continue;
+        }
+        for(int stage = 0; stage < NUM_STAGES; ++stage)
+        {
+            if(times.ns[stage] < best->ns[stage])
+            {
+                best->ns[stage] = times.ns[stage];
+            }
+        }
+    }
+}
+
+void PrintStageTimes(const char *name, StageTimes *times)
+{
+    for(int stage = 0; stage < NUM_STAGES; ++stage)
+    {
+        if(!times->ran[stage])
+        {
+            continue;
+        }
+        double ms = times->ns[stage] / 1e6;
+        double mb_per_s = (times->ns[stage] > 0) ? (times->bytes / 1e6) / (times->ns[stage] / 1e9) : 0;
+        printf("%-12s %9.2f MB  %-9s %10.3f ms %9.1f MB/s %8d allocs\n", name, times->bytes / 1e6,
+               stage_names[stage], ms, mb_per_s, times->allocations[stage]);
+    }
+}
+
+// NOTE least squares fit of log(time) against log(size), the slope is the exponent of the growth,
+// the stages that take less than a millisecond on the largest input are too noisy to judge
+bool CheckScaling(const char *name, StageTimes *runs, int num_runs, double max_slope)
+{
+    bool superlinear = false;
+    for(int stage = 0; stage < NUM_STAGES; ++stage)
+    {
+        double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+        int n = 0;
+        uint64_t largest_ns = 0;
+        size_t largest_bytes = 0;
+        for(int i = 0; i < num_runs; ++i)
+        {
+            if(!runs[i].ran[stage] || runs[i].bytes == 0 || runs[i].ns[stage] == 0)
+            {
+                continue;
+            }
+            double x = log((double)runs[i].bytes);
+            double y = log((double)runs[i].ns[stage]);
+            sum_x += x;
+            sum_y += y;
+            sum_xx += x * x;
+            sum_xy += x * y;
+            n++;
+            if(runs[i].bytes >= largest_bytes)
+            {
+                largest_bytes = runs[i].bytes;
+                largest_ns = runs[i].ns[stage];
+            }
+        }
+
+        double denominator = n * sum_xx - sum_x * sum_x;
+        if(n < 3 || denominator <= 0)
+        {
+            continue;
+        }
+        double slope = (n * sum_xy - sum_x * sum_y) / denominator;
+        bool flagged = slope > max_slope && largest_ns >= 1000000;
+        printf("%-12s %-9s grows as size^%.2f%s\n", name, stage_names[stage], slope, flagged ? "  SUPERLINEAR" : "");
+        superlinear = superlinear || flagged;
+    }
+
+    return superlinear;
+}
+
+bool RunGenerator(Generator *generator, BenchOptions *bench, RainbowOptions *options)
+{
+    StageTimes *runs = (StageTimes *)calloc(bench->num_sizes, sizeof(StageTimes));
+    size_t size = bench->size;
+    for(int i = 0; i < bench->num_sizes; ++i, size *= 2)
+    {
+        OutputBuffer text = {};
+        uint32_t seed = 0x9e3779b9;
+        generator->generate(&text, size, &seed);
+
+        String input = {text.data, text.length, 0};
+        RunStagesRepeated(&input, options, bench->repeats, &runs[i]);
+        PrintStageTimes(generator->name, &runs[i]);
+        Free(&text);
+    }
+
+    bool superlinear = CheckScaling(generator->name, runs, bench->num_sizes, bench->max_slope);
+    free(runs);
+
+    return superlinear;
+}
+
+// NOTE the files of a tree are parsed with the filetype of their extension, their sizes vary so
+// the fit is done across them
+bool RunTree(BenchOptions *bench, RainbowOptions *options)
+{
+    BatchOptions batch = {};
+    batch.file_types = default_file_types;
+    batch.num_file_types = NUM_DEFAULT_FILE_TYPES;
+
+    BatchFileVector files = {};
+    for(int i = 0; i < bench->num_paths; ++i)
+    {
+        CollectBatchFiles(&batch, &files, bench->paths[i], true);
+    }
+
+    StageTimes *runs = (StageTimes *)calloc(files.len + 1, sizeof(StageTimes));
+    StageTimes total = {};
+    for(int i = 0; i < files.len; ++i)
+    {
+        String input = MapSource(files.array[i].path);
+        if(!input.data)
+        {
+            continue;
+        }
+
+        options->filetype = files.array[i].filetype;
+        RunStagesRepeated(&input, options, bench->repeats, &runs[i]);
+        Free(&input);
+
+        total.bytes += runs[i].bytes;
+        for(int stage = 0; stage < NUM_STAGES; ++stage)
+        {
+            total.ran[stage] = total.ran[stage] || runs[i].ran[stage];
+            total.ns[stage] += runs[i].ns[stage];
+            total.allocations[stage] += runs[i].allocations[stage];
+        }
+    }
+
+    printf("%d files\n", files.len);
+    PrintStageTimes("tree", &total);
+    bool superlinear = CheckScaling("tree", runs, files.len, bench->max_slope);
+
+    free(runs);
+    Free(&files);
+
+    return superlinear;
+}
+
+bool ParseBenchOptions(int argc, const char **argv, BenchOptions *bench)
+{
+    bench->filetype = "cpp";
+    bench->size = 512 * 1024;
+    bench->num_sizes = 5;
+    bench->repeats = 3;
+    bench->generator = NULL;
+    bench->languages_path = "rc/languages";
+    bench->check_templates = 'Y';
+    bench->check_pound_ifs = 'Y';
+    bench->mode = '2';
+    bench->max_slope = 1.25;
+
+    int i = 1;
+    for(; i + 1 < argc && argv[i][0] == '-' && argv[i][1] && !argv[i][2]; i += 2)
+    {
+        const char *value = argv[i + 1];
+        switch(argv[i][1])
+        {
+            case 'f': bench->filetype = value; break;
+            case 's': bench->size = (size_t)atol(value) * 1024; break;
+            case 'n': bench->num_sizes = atoi(value); break;
+            case 'r': bench->repeats = atoi(value); break;
+            case 'g': bench->generator = value; break;
+            case 'l': bench->languages_path = value; break;
+            case 't': bench->check_templates = value[0]; break;
+            case 'p': bench->check_pound_ifs = value[0]; break;
+            case 'm': bench->mode = value[0]; break;
+            case 'x': bench->max_slope = atof(value); break;
+            default: return false;
+        }
+    }
+
+    bench->paths = argv + i;
+    bench->num_paths = argc - i;
+
+    return i == argc || argv[i][0] != '-';
+}
+
+int main(int argc, const char **argv)
+{
+    BenchOptions bench = {};
+    if(!ParseBenchOptions(argc, argv, &bench) || bench.size == 0 || bench.num_sizes < 1 || bench.repeats < 1)
+    {
+        fprintf(stderr, "usage: rainbower-bench [-f filetype] [-s size KB] [-n sizes] [-r repeats] [-g generator] "
+                        "[-l languages] [-t Y|n] [-p Y|n] [-m mode] [-x slope] [files and directories]...\n");
+        return 2;
+    }
+
+    // NOTE the whole buffer is in the window, so the output has every bracket
+    char mode[2] = {bench.mode, 0};
+    char check_templates[2] = {bench.check_templates, 0};
+    char check_pound_ifs[2] = {bench.check_pound_ifs, 0};
+    const char *arguments[] = {"rainbower", "bench", "0", mode, "1.1", "1.1", "99999999.99999999",
+                               bench.filetype, check_templates, check_pound_ifs,
+                               "rgb:FF6A00", "rgb:FFD800", "rgb:00FF00", "rgb:0094FF",
+                               "!", "rgb:331500", "rgb:332200"};
+    RainbowOptions options;
+    ParseOptions((int)(sizeof(arguments) / sizeof(arguments[0])), arguments, &options);
+    options.languages = LoadLanguages(bench.languages_path, NULL);
+
+    bool superlinear = false;
+    if(bench.num_paths > 0)
+    {
+        superlinear = RunTree(&bench, &options);
+    }
+    else
+    {
+        bool found = false;
+        for(int i = 0; i < NUM_GENERATORS; ++i)
+        {
+            if(!bench.generator || strcmp(bench.generator, generators[i].name) == 0)
+            {
+                found = true;
+                superlinear = RunGenerator(&generators[i], &bench, &options) || superlinear;
+            }
+        }
+        if(!found)
+        {
+            fprintf(stderr, "unknown generator %s\n", bench.generator);
+            return 2;
+        }
+    }
+
+    Free(options.languages);
+
+    return superlinear ? 1 : 0;
+}
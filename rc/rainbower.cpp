@@ -25,6 +25,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <time.h>
+#include <pwd.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#define RAINBOWER_X86 1
+#else
+#define RAINBOWER_X86 0
+#endif
 
 struct IntPair
 {
@@ -69,34 +89,160 @@ IntPair ParsePair(const char *c)
     return p;
 }
 
+// NOTE all the memory of a parse comes from an arena that is reset and reused by the next
+// one, when a parse does not fit in one block the blocks get merged on reset so that the
+// following parses don't have to allocate anymore
+#define ARENA_MIN_BLOCK_SIZE (64 * 1024)
+
+struct ArenaBlock
+{
+    ArenaBlock *previous;
+    size_t size;
+    size_t used;
+};
+
+#define ARENA_HEADER_SIZE ((sizeof(ArenaBlock) + 15) & ~(size_t)15)
+
+struct Arena
+{
+    ArenaBlock *block;
+    size_t used;
+
+    // NOTE number of blocks taken from the system so far
+    int num_allocations;
+};
+
+ArenaBlock *AllocateArenaBlock(Arena *arena, size_t size, ArenaBlock *previous)
+{
+    ArenaBlock *block = (ArenaBlock *)malloc(ARENA_HEADER_SIZE + size);
+    block->previous = previous;
+    block->size = size;
+    block->used = 0;
+
+    arena->num_allocations++;
+
+    return block;
+}
+
+void *PushSize(Arena *arena, size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+
+    ArenaBlock *block = arena->block;
+    if(!block || block->used + size > block->size)
+    {
+        size_t block_size = block ? block->size * 2 : ARENA_MIN_BLOCK_SIZE;
+        if(block_size < size)
+        {
+            block_size = size;
+        }
+        block = AllocateArenaBlock(arena, block_size, block);
+        arena->block = block;
+    }
+
+    void *result = (char *)block + ARENA_HEADER_SIZE + block->used;
+    block->used += size;
+    arena->used += size;
+
+    return result;
+}
+
+#define PushArray(arena, type, count) (type *)PushSize(arena, sizeof(type) * (count))
+
+void FreeArenaBlocks(ArenaBlock *block)
+{
+    while(block)
+    {
+        ArenaBlock *previous = block->previous;
+        free(block);
+        block = previous;
+    }
+}
+
+void ResetArena(Arena *arena)
+{
+    if(arena->block && arena->block->previous)
+    {
+        size_t size = arena->used + arena->used / 2;
+        FreeArenaBlocks(arena->block);
+        arena->block = AllocateArenaBlock(arena, size, NULL);
+    }
+    else if(arena->block)
+    {
+        arena->block->used = 0;
+    }
+
+    arena->used = 0;
+}
+
+void Free(Arena *arena)
+{
+    FreeArenaBlocks(arena->block);
+    arena->block = NULL;
+    arena->used = 0;
+}
+
+// NOTE offset is the byte offset of the bracket in the buffer, the pairs are stored with it
 struct CharPosition
 {
     IntPair pair;
     char c;
     int level;
+    uint32_t offset;
 };
 
+// NOTE vectors with an arena never free their memory, the arena does
 struct CharPositionVector
 {
     CharPosition *array;
     int len;
     int size;
+
+    Arena *arena;
 };
 
-void Insert(CharPositionVector *vector, CharPosition elem)
+CharPositionVector MakeVector(Arena *arena, int size)
 {
-    if(vector->array == NULL)
+    CharPositionVector vector = {};
+    vector.arena = arena;
+    if(size > 0)
     {
-        vector->array = (CharPosition *)malloc(2 * sizeof(CharPosition));
-        vector->size = 2;
-        vector->len = 0;
+        vector.array = PushArray(arena, CharPosition, size);
+        vector.size = size;
     }
-    else if(vector->len == vector->size)
+    return vector;
+}
+
+void Reserve(CharPositionVector *vector, int size)
+{
+    if(size <= vector->size)
     {
-        int new_size = vector->size * 1.5f;
-        int alloc_size = sizeof(CharPosition) * new_size;
-        vector->array = (CharPosition *)realloc(vector->array, alloc_size);
-        vector->size = new_size;
+        return;
+    }
+
+    CharPosition *array;
+    if(vector->arena)
+    {
+        array = PushArray(vector->arena, CharPosition, size);
+        if(vector->len)
+        {
+            memcpy(array, vector->array, sizeof(CharPosition) * vector->len);
+        }
+    }
+    else
+    {
+        array = (CharPosition *)realloc(vector->array, sizeof(CharPosition) * size);
+    }
+
+    vector->array = array;
+    vector->size = size;
+}
+
+void Insert(CharPositionVector *vector, CharPosition elem)
+{
+    if(vector->len == vector->size)
+    {
+        Reserve(vector, vector->size ? vector->size * 2 : 16);
     }
 
     vector->array[vector->len] = elem;
@@ -105,88 +251,147 @@ void Insert(CharPositionVector *vector, CharPosition elem)
 
 void Free(CharPositionVector *vector)
 {
-    if(vector->array)
+    if(vector->array && !vector->arena)
     {
         free(vector->array);
-        vector->array = 0;
     }
+    *vector = {};
 }
 
-struct RainbowStack
+// NOTE the bracket stack is a vector with the top at the end
+void PushCharPosition(CharPositionVector *s, CharPosition data)
 {
-    CharPosition data;
-    struct RainbowStack *previous;
+    Insert(s, data);
+}
+
+void PopCharPosition(CharPositionVector *s)
+{
+    if(s->len > 0)
+    {
+        s->len--;
+    }
+}
+
+// NOTE the pairs as parallel arrays, 10 bytes a pair, the brackets are byte offsets in the
+// buffer so their lines and columns are only computed for the ranges that are printed, the
+// levels wrap after 65535 nested brackets
+struct PairVector
+{
+    uint32_t *open;
+    uint32_t *close;
+    uint16_t *level;
+    int len;
+    int size;
+
+    Arena *arena;
 };
 
-void PushCharPosition(RainbowStack **s, CharPosition data)
+void Reserve(PairVector *vector, int size)
 {
-    RainbowStack *new_element = (RainbowStack *)malloc(sizeof(RainbowStack));
+    if(size <= vector->size)
+    {
+        return;
+    }
 
-    if(new_element)
+    uint32_t *open = PushArray(vector->arena, uint32_t, size);
+    uint32_t *close = PushArray(vector->arena, uint32_t, size);
+    uint16_t *level = PushArray(vector->arena, uint16_t, size);
+    if(vector->len)
     {
-        new_element->data = data;
-        new_element->previous = *s;
+        memcpy(open, vector->open, sizeof(uint32_t) * vector->len);
+        memcpy(close, vector->close, sizeof(uint32_t) * vector->len);
+        memcpy(level, vector->level, sizeof(uint16_t) * vector->len);
     }
 
-    *s = new_element;
+    vector->open = open;
+    vector->close = close;
+    vector->level = level;
+    vector->size = size;
 }
 
-void PopCharPosition(RainbowStack **s)
+PairVector MakePairVector(Arena *arena, int size)
 {
-    if(*s)
-    {
-        RainbowStack *previous = (*s)->previous;
-
-        free(*s);
+    PairVector vector = {};
+    vector.arena = arena;
+    Reserve(&vector, size);
+    return vector;
+}
 
-        *s = previous;
+void Insert(PairVector *vector, uint32_t open, uint32_t close, int level)
+{
+    if(vector->len == vector->size)
+    {
+        Reserve(vector, vector->size ? vector->size * 2 : 16);
     }
+
+    vector->open[vector->len] = open;
+    vector->close[vector->len] = close;
+    vector->level[vector->len] = (uint16_t)level;
+    vector->len++;
 }
 
-void Free(RainbowStack **s)
+// NOTE the offsets the lines start at, the bracket passes fill it as they go through the lines
+struct OffsetVector
+{
+    uint32_t *array;
+    int len;
+    int size;
+
+    Arena *arena;
+};
+
+OffsetVector MakeOffsetVector(Arena *arena, int size)
 {
-    while(*s)
+    OffsetVector vector = {};
+    vector.arena = arena;
+    if(size > 0)
     {
-        PopCharPosition(s);
+        vector.array = PushArray(arena, uint32_t, size);
+        vector.size = size;
     }
+    return vector;
 }
 
-bool IsMaxPair(IntPair pair_a, IntPair pair_b)
+void Reserve(OffsetVector *vector, int size)
 {
-    if(pair_a.a > pair_b.a)
+    if(size <= vector->size)
     {
-        return true;
+        return;
     }
-    else if(pair_a.a < pair_b.a)
+
+    uint32_t *array = PushArray(vector->arena, uint32_t, size);
+    if(vector->len)
     {
-        return false;
+        memcpy(array, vector->array, sizeof(uint32_t) * vector->len);
     }
-    else
+    vector->array = array;
+    vector->size = size;
+}
+
+void Insert(OffsetVector *vector, uint32_t elem)
+{
+    if(vector->len == vector->size)
     {
-        if(pair_a.b >= pair_b.b)
-        {
-            return true;
-        }
-        else
-        {
-            return false;
-        }
+        Reserve(vector, vector->size ? vector->size * 2 : 1024);
     }
+
+    vector->array[vector->len] = elem;
+    vector->len++;
 }
 
-bool IsMinPair(IntPair pair_a, IntPair pair_b)
+bool IsMaxPair(IntPair pair_a, IntPair pair_b)
 {
-    if(pair_a.a < pair_b.a)
+    if(pair_a.a > pair_b.a)
     {
         return true;
     }
-    else if(pair_a.a > pair_b.a)
+    else if(pair_a.a < pair_b.a)
     {
         return false;
     }
     else
     {
-        if(pair_a.b <= pair_b.b)
+        if(pair_a.b >= pair_b.b)
         {
             return true;
         }
@@ -197,13 +402,6 @@ bool IsMinPair(IntPair pair_a, IntPair pair_b)
     }
 }
 
-bool IsRangeVisible(IntPair pair_a, IntPair pair_b, IntPair bound_a, IntPair bound_b)
-{
-    return ((IsMaxPair(pair_a, bound_a) && IsMinPair(pair_a, bound_b)) ||
-            (IsMaxPair(pair_b, bound_a) && IsMinPair(pair_b, bound_b)) ||
-            (IsMinPair(pair_a, bound_a) && IsMaxPair(pair_b, bound_b)));
-}
-
 char GetMatchingPair(char c)
 {
     switch(c)
@@ -216,885 +414,7599 @@ char GetMatchingPair(char c)
     }
 }
 
-int InsertPair(CharPositionVector *result, RainbowStack **s, int level, char opening_bracket, CharPosition p)
+int InsertPair(PairVector *result, CharPositionVector *s, int level, char opening_bracket, CharPosition p)
 {
-    RainbowStack *copy = *s;
-    while(copy && copy->data.c != opening_bracket)
+    int i = s->len - 1;
+    while(i >= 0 && s->array[i].c != opening_bracket)
     {
-        copy = copy->previous;
+        i--;
     }
-    if(copy)
+    if(i >= 0)
     {
-        while(*s != copy)
-        {
-            PopCharPosition(s);
-            level--;
-        }
-        CharPosition p2 = (*s)->data;
-        p.level = p2.level;
-        Insert(result, p);
-        Insert(result, p2);
-        PopCharPosition(s);
+        // NOTE the brackets above the matching one are left open
+        level -= s->len - 1 - i;
+        CharPosition p2 = s->array[i];
+        Insert(result, p2.offset, p.offset, p2.level);
+        s->len = i;
         level--;
     }
 
     return level;
 }
 
-struct CharPair
+// NOTE the parsers only look at a few characters, the scanner classifies 64 bytes at a time
+// and lets them jump from one interesting character to the next
+enum ScanClass
 {
-    char a, b;
+    SCAN_BRACKET = 1 << 0,
+    SCAN_ANGLE = 1 << 1,
+    SCAN_QUOTE = 1 << 2,
+    SCAN_BACKSLASH = 1 << 3,
+    SCAN_SLASH = 1 << 4,
+    SCAN_STAR = 1 << 5,
+    SCAN_POUND = 1 << 6,
+    SCAN_NEWLINE = 1 << 7,
+    SCAN_EXTRA = 1 << 8,
+    SCAN_NULL = 1 << 9,
 };
 
-CharPositionVector ParseGenericFile(const char *buffer, CharPositionVector generics = {}, CharPair generic_pair = {})
+#define SCAN_CLASS_COUNT 10
+#define SCAN_BLOCK_SIZE 64
+
+struct ScanClassChars
 {
-    CharPositionVector result = {};
+    char chars[8];
+    int count;
+};
 
-    RainbowStack *s = NULL;
+struct Scanner
+{
+    const char *buffer;
+    const char *end;
 
-    IntPair cur_pos = { 1, 1 };
+    int classes;
+    ScanClassChars class_chars[SCAN_CLASS_COUNT];
+    uint16_t table[256];
+    bool use_avx2;
 
-    int level = 0;
-    int generic_i = 0;
+    const char *block;
+    uint64_t masks[SCAN_CLASS_COUNT];
+};
+
+// NOTE extra is a per language set of characters, like the ones ending a template
+void StartScanner(Scanner *scanner, const char *buffer, size_t length, int classes, const char *extra = "")
+{
+    const char *class_chars[SCAN_CLASS_COUNT] = {"()[]{}", "<>", "\"'", "\\", "/", "*", "#", "\n", extra, ""};
+
+    memset(scanner, 0, sizeof(*scanner));
+    scanner->buffer = buffer;
+    scanner->end = buffer + length;
+    scanner->classes = classes | SCAN_NULL;
 
-    for(const char *c = buffer; *c != '\0'; c++)
+    for(int i = 0; i < SCAN_CLASS_COUNT; ++i)
     {
-        IntPair current_generic = {};
-        if(generic_i < generics.len)
+        ScanClassChars *chars = &scanner->class_chars[i];
+        for(const char *c = class_chars[i]; *c && chars->count < 8; c++)
         {
-            current_generic = generics.array[generic_i].pair;
+            chars->chars[chars->count++] = *c;
         }
-        if(*c == '\n')
+        if((1 << i) == SCAN_NULL)
         {
-            cur_pos.a++;
-            cur_pos.b = 1;
+            chars->chars[chars->count++] = '\0';
         }
-        else
+
+        if(scanner->classes & (1 << i))
         {
-            CharPosition p = {};
-            p.c = *c;
-            p.pair = cur_pos;
-            if(*c == '(' || *c == '[' || *c == '{' ||
-               (current_generic.a == cur_pos.a && current_generic.b == cur_pos.b
-                && *c == generic_pair.a))
-            {
-                p.level = level;
-                PushCharPosition(&s, p);
-                level++;
-                if(current_generic.a == cur_pos.a && current_generic.b == cur_pos.b)
-                {
-                    generic_i++;
-                }
-            }
-            else if(p.c == ')' || p.c == ']' || p.c == '}' ||
-                    (current_generic.a == cur_pos.a && current_generic.b == cur_pos.b
-                     && *c == generic_pair.b))
+            for(int k = 0; k < chars->count; ++k)
             {
-                char opening_bracket = GetMatchingPair(*c);
-                level = InsertPair(&result, &s, level, opening_bracket, p);
-                if(current_generic.a == cur_pos.a && current_generic.b == cur_pos.b)
-                {
-                    generic_i++;
-                }
+                scanner->table[(unsigned char)chars->chars[k]] |= (1 << i);
             }
-            cur_pos.b++;
         }
     }
 
-    Free(&s);
-
-    return result;
+#if RAINBOWER_X86
+    scanner->use_avx2 = __builtin_cpu_supports("avx2");
+#endif
 }
 
-bool DeleteLessThanSign(CharPositionVector *vec)
+void ClassifyBlockScalar(Scanner *scanner, const char *block, int length)
 {
-    int found = -1;
-    int closing = 0;
-
-    for(int i = vec->len - 1; i >= 0; --i)
+    for(int i = 0; i < length; ++i)
     {
-        if(vec->array[i].c == '<')
+        uint16_t classes = scanner->table[(unsigned char)block[i]];
+        for(int k = 0; classes; ++k, classes >>= 1)
         {
-            if(closing)
+            if(classes & 1)
             {
-                closing--;
-            }
-            else
-            {
-                found = i;
-                break;
+                scanner->masks[k] |= (uint64_t)1 << i;
             }
         }
-        else
-        {
-            closing++;
-        }
+    }
+}
+
+#if RAINBOWER_X86
+void ClassifyBlockSSE2(Scanner *scanner, const char *block)
+{
+    __m128i v[4];
+    for(int i = 0; i < 4; ++i)
+    {
+        v[i] = _mm_loadu_si128((const __m128i *)(block + 16 * i));
     }
 
-    if(found != -1)
+    for(int k = 0; k < SCAN_CLASS_COUNT; ++k)
     {
-        for(int i = found + 1; i < vec->len; ++i)
+        if(!(scanner->classes & (1 << k)))
         {
-            vec->array[i - 1] = vec->array[i];
+            continue;
         }
-        vec->len--;
-    }
 
-    return (found != -1);
+        ScanClassChars *chars = &scanner->class_chars[k];
+        uint64_t mask = 0;
+        for(int i = 0; i < 4; ++i)
+        {
+            __m128i m = _mm_setzero_si128();
+            for(int j = 0; j < chars->count; ++j)
+            {
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v[i], _mm_set1_epi8(chars->chars[j])));
+            }
+            mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(m) << (16 * i);
+        }
+        scanner->masks[k] = mask;
+    }
 }
 
-int NumPairable(CharPositionVector vec)
+__attribute__((target("avx2")))
+void ClassifyBlockAVX2(Scanner *scanner, const char *block)
 {
-    int count = 0;
+    __m256i lo = _mm256_loadu_si256((const __m256i *)block);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(block + 32));
 
-    for(int i = 0; i < vec.len; ++i)
+    for(int k = 0; k < SCAN_CLASS_COUNT; ++k)
     {
-        if(vec.array[i].c == '<')
+        if(!(scanner->classes & (1 << k)))
         {
-            count++;
+            continue;
         }
-        else
+
+        ScanClassChars *chars = &scanner->class_chars[k];
+        __m256i m_lo = _mm256_setzero_si256();
+        __m256i m_hi = _mm256_setzero_si256();
+        for(int j = 0; j < chars->count; ++j)
         {
-            count--;
+            __m256i c = _mm256_set1_epi8(chars->chars[j]);
+            m_lo = _mm256_or_si256(m_lo, _mm256_cmpeq_epi8(lo, c));
+            m_hi = _mm256_or_si256(m_hi, _mm256_cmpeq_epi8(hi, c));
         }
+        scanner->masks[k] = ((uint64_t)(uint32_t)_mm256_movemask_epi8(m_hi) << 32) |
+                            (uint32_t)_mm256_movemask_epi8(m_lo);
     }
-
-    return count;
 }
+#endif
 
-struct StringParsingInfo
+void ClassifyBlock(Scanner *scanner, const char *block)
 {
-    char current_string;
-    int current_string_count;
-    bool closed_string;
-};
+    scanner->block = block;
 
-void CContinueString(StringParsingInfo *info, const char *c)
-{
-    if((info->current_string == '\'' && *c == '\'') &&
-       (*(c - 1) != '\\' || *(c - 2) == '\\'))
+    long length = scanner->end - block;
+    if(length < SCAN_BLOCK_SIZE)
     {
-        info->current_string = '\0';
+        memset(scanner->masks, 0, sizeof(scanner->masks));
+        ClassifyBlockScalar(scanner, block, length);
+        return;
     }
-    else if((info->current_string == '\"' && *c == '\"') &&
-            (*(c - 1) != '\\' || *(c - 2) == '\\'))
+
+#if RAINBOWER_X86
+    if(scanner->use_avx2)
     {
-        info->current_string = '\0';
+        ClassifyBlockAVX2(scanner, block);
     }
+    else
+    {
+        ClassifyBlockSSE2(scanner, block);
+    }
+#else
+    memset(scanner->masks, 0, sizeof(scanner->masks));
+    ClassifyBlockScalar(scanner, block, SCAN_BLOCK_SIZE);
+#endif
 }
 
-bool CCheckCloseMultilineComment(const char *c, const char *multiline_comment)
-{
-    return (*c == '/' && *(c - 1) == '*' && c != multiline_comment + 1);
-}
-
-bool CCheckStartMultilineComment(const char *c, const char *buffer, const char *last_closed_comment)
-{
-    return (last_closed_comment != (c - 1) && *c == '*' && c != buffer && *(c - 1) == '/');
-}
-
-bool CCheckStartLineComment(const char *c, const char *buffer, const char *last_closed_comment)
-{
-    return (last_closed_comment != (c - 1) && *c == '/' && c != buffer && *(c - 1) == '/');
-}
-
-struct ParsingResult
+// NOTE returns the first character from c on that is in one of the classes, or the end
+const char *ScanNext(Scanner *scanner, const char *c, int classes)
 {
-    IntPair cursor;
-    bool end;
-};
+    classes |= SCAN_NULL;
 
-ParsingResult AdvanceParsing(const char c, const char **words, int num_words, IntPair cursor)
-{
-    if(cursor.a >= num_words || cursor.b >= strlen(words[cursor.a]))
-    {
-        exit(1); // TODO: print debugging info???
-    }
-    const char current_char = words[cursor.a][cursor.b];
-    if(current_char == c)
+    while(c < scanner->end)
     {
-        if(cursor.b == strlen(words[cursor.a]) - 1)
+        size_t block_offset = (c - scanner->buffer) & ~(size_t)(SCAN_BLOCK_SIZE - 1);
+        const char *block = scanner->buffer + block_offset;
+        if(block != scanner->block)
         {
-            if(cursor.a == num_words - 1)
-            {
-                return {{0, 0}, true};
-            }
-            else
+            ClassifyBlock(scanner, block);
+        }
+
+        uint64_t mask = 0;
+        for(int k = 0, bits = classes; bits; ++k, bits >>= 1)
+        {
+            if(bits & 1)
             {
-                return {{cursor.a + 1, 0}, false};
+                mask |= scanner->masks[k];
             }
         }
-        else
+        mask &= ~(uint64_t)0 << (c - block);
+
+        if(mask)
         {
-            return {{cursor.a, cursor.b + 1}, false};
+            return block + __builtin_ctzll(mask);
         }
+
+        c = block + SCAN_BLOCK_SIZE;
     }
-    else if(c == ' ' && cursor.b == 0)
-    {
-        return {cursor, false};
-    }
-    else
-    {
-        return {};
-    }
+
+    return scanner->end;
 }
 
-struct PoundIfParsing
+// NOTE counts the characters in the classes, used to size the vectors up front
+// NOTE the newlines can be counted in the same pass, they are not part of the count
+size_t ScanCount(Scanner *scanner, int classes, size_t *newlines = NULL)
 {
-    IntPair pound_if_zero;
-    IntPair pound_if_one;
-    IntPair pound_endif;
-    IntPair pound_else;
+    size_t count = 0;
+    for(const char *block = scanner->buffer; block < scanner->end; block += SCAN_BLOCK_SIZE)
+    {
+        ClassifyBlock(scanner, block);
 
-    // NOTE: if you have more than 1000 nested #ifs then you have a problem
-    char pound_if_stack[1000];
-    int pound_if_level;
+        uint64_t mask = 0;
+        for(int k = 0, bits = classes; bits; ++k, bits >>= 1)
+        {
+            if(bits & 1)
+            {
+                mask |= scanner->masks[k];
+            }
+        }
+        count += __builtin_popcountll(mask);
+        if(newlines)
+        {
+            *newlines += __builtin_popcountll(scanner->masks[__builtin_ctz(SCAN_NEWLINE)]);
+        }
+    }
 
-    bool stop_highlighting;
-};
+    return count;
+}
 
-void ParsePoundIfs(char c, PoundIfParsing *parser)
+// NOTE blanks the characters from c on into out up to the first one in stop_classes, except for
+// the ones in keep_classes, returns where it stopped and adds the kept ones to count
+const char *ScanBlank(Scanner *scanner, const char *c, int keep_classes, int stop_classes, char *out, int *count)
 {
-    bool check_for_not_zero_one_if = false;
-    bool found_zero_or_one = false;
-    const char *pound_if_one_words[] = {"#", "if", " ", "1"};
-    const char *pound_if_zero_words[] = {"#", "if", " ", "0"};
-    const char *else_words[] = {"#", "else"};
-    const char *endif_words[] = {"#", "endif"};
-
-    ParsingResult r;
+    stop_classes |= SCAN_NULL;
 
-    if(parser->pound_if_zero.a == 3 && parser->pound_if_one.a == 3)
+    const char *from = c;
+    size_t block_offset = (c - scanner->buffer) & ~(size_t)(SCAN_BLOCK_SIZE - 1);
+    for(const char *block = scanner->buffer + block_offset; block < scanner->end; block += SCAN_BLOCK_SIZE)
     {
-        check_for_not_zero_one_if = true;
+        if(block != scanner->block)
+        {
+            ClassifyBlock(scanner, block);
+        }
+
+        uint64_t keep = 0;
+        uint64_t stop = 0;
+        for(int k = 0; k < SCAN_CLASS_COUNT; ++k)
+        {
+            if(keep_classes & (1 << k))
+            {
+                keep |= scanner->masks[k];
+            }
+            if(stop_classes & (1 << k))
+            {
+                stop |= scanner->masks[k];
+            }
+        }
+        if(block < c)
+        {
+            keep &= ~(uint64_t)0 << (c - block);
+            stop &= ~(uint64_t)0 << (c - block);
+        }
+
+        const char *end = block + SCAN_BLOCK_SIZE;
+        if(stop)
+        {
+            end = block + __builtin_ctzll(stop);
+            keep &= ((uint64_t)1 << __builtin_ctzll(stop)) - 1;
+        }
+        else if(end > scanner->end)
+        {
+            end = scanner->end;
+        }
+
+        const char *start = (block < c) ? c : block;
+        memset(out + (start - from), ' ', end - start);
+        for(; keep; keep &= keep - 1)
+        {
+            const char *kept = block + __builtin_ctzll(keep);
+            out[kept - from] = *kept;
+            (*count)++;
+        }
+
+        if(stop)
+        {
+            return end;
+        }
+    }
+
+    return scanner->end;
+}
+
+struct CharPair
+{
+    char a, b;
+};
+
+struct StringParsingInfo
+{
+    char current_string;
+    int current_string_count;
+    bool closed_string;
+};
+
+// NOTE NAME and NAME=VALUE define a macro and !NAME makes it undefined, the #ifs on any other
+// macro can't be evaluated and all of their branches are shown
+struct PoundIfDefines
+{
+    const char **names;
+    int count;
+};
+
+// NOTE the state of the current branch of an #if chain, shown is set when its code is shown
+// and settled when the branches that follow don't depend on their condition anymore, either
+// because one was already taken or because one couldn't be evaluated
+#define POUND_IF_SHOWN 1
+#define POUND_IF_SETTLED 2
+
+#define POUND_IF_PENDING 0
+#define POUND_IF_TAKEN POUND_IF_SHOWN
+#define POUND_IF_DONE POUND_IF_SETTLED
+#define POUND_IF_UNKNOWN (POUND_IF_SHOWN | POUND_IF_SETTLED)
+
+// NOTE: if you have more than 1024 nested #ifs then you have a problem, the ones past it are
+// always shown
+#define POUND_IF_MAX_LEVELS 1024
+
+struct PoundIfParsing
+{
+    // NOTE one bit per nesting level, the bits past the level are always zero
+    uint64_t shown[POUND_IF_MAX_LEVELS / 64];
+    uint64_t settled[POUND_IF_MAX_LEVELS / 64];
+    int level;
+    int hidden_levels;
+
+    // NOTE a directive only opens its branch at the end of its line, so the line itself is
+    // part of the enclosing block
+    bool pending;
+    int pending_state;
+
+    // NOTE only used when a chunk is lexed without knowing the #ifs it starts in, the levels
+    // below base_level stand for those, see ComposePoundIfs
+    int base_level;
+    int min_level;
+    int max_level;
+    bool base_branched;
+};
+
+// NOTE every pass saves its state at the start of a line every CHECKPOINT_INTERVAL lines,
+// when the buffer changes it restarts from the last checkpoint before the change and stops
+// at the first checkpoint after it where the state is the same as in the previous run, from
+// there on the previous result is reused with the positions shifted
+#define CHECKPOINT_INTERVAL 256
+
+struct Checkpoint
+{
+    size_t offset;
+    int line;
+
+    // NOTE comments and strings, lexer_state is the state of the lexer of the languages file
+    StringParsingInfo info;
+    int comment_depth;
+    PoundIfParsing *pound_ifs;
+    int lexer_state;
+
+    // NOTE brackets and angle brackets, the stack is stored in CheckpointVector::stacks
+    int level;
+    int generic_index;
+    int result_len;
+    int stack_start;
+    int stack_len;
+};
+
+struct CheckpointVector
+{
+    Checkpoint *array;
+    int len;
+    int size;
+
+    CharPositionVector stacks;
+    Arena *arena;
+};
+
+CheckpointVector MakeCheckpointVector(Arena *arena)
+{
+    CheckpointVector vector = {};
+    vector.arena = arena;
+    vector.stacks = MakeVector(arena, 0);
+    return vector;
+}
+
+void Insert(CheckpointVector *vector, Checkpoint elem)
+{
+    if(vector->len == vector->size)
+    {
+        int new_size = vector->size ? vector->size * 2 : 64;
+        Checkpoint *array = PushArray(vector->arena, Checkpoint, new_size);
+        if(vector->len)
+        {
+            memcpy(array, vector->array, sizeof(Checkpoint) * vector->len);
+        }
+        vector->array = array;
+        vector->size = new_size;
+    }
+
+    vector->array[vector->len] = elem;
+    vector->len++;
+}
+
+// NOTE [start, old_end) in the old buffer was replaced by [start, new_end) in the new one
+struct ParseEdit
+{
+    size_t start;
+    size_t old_end;
+    size_t new_end;
+
+    IntPair start_pos;
+    IntPair old_end_pos;
+    IntPair new_end_pos;
+};
+
+bool MapPosition(ParseEdit *edit, IntPair pair, IntPair *result)
+{
+    if(!edit || !IsMaxPair(pair, edit->start_pos))
+    {
+        *result = pair;
+        return true;
+    }
+    else if(IsMaxPair(pair, edit->old_end_pos))
+    {
+        if(pair.a == edit->old_end_pos.a)
+        {
+            result->a = edit->new_end_pos.a;
+            result->b = pair.b - edit->old_end_pos.b + edit->new_end_pos.b;
+        }
+        else
+        {
+            result->a = pair.a + edit->new_end_pos.a - edit->old_end_pos.a;
+            result->b = pair.b;
+        }
+        return true;
+    }
+
+    // NOTE the position was inside the changed text
+    return false;
+}
+
+// NOTE like MapPosition for an offset that is not inside the changed text
+uint32_t MapOffset(ParseEdit *edit, uint32_t offset)
+{
+    if(!edit || offset < edit->old_end)
+    {
+        return offset;
+    }
+    return (uint32_t)(offset + edit->new_end - edit->old_end);
+}
+
+bool IsSameCharPosition(ParseEdit *edit, CharPosition old_p, CharPosition p)
+{
+    IntPair pair;
+    return (MapPosition(edit, old_p.pair, &pair) && pair.a == p.pair.a && pair.b == p.pair.b &&
+            old_p.c == p.c && old_p.level == p.level);
+}
+
+struct IncrementalRun
+{
+    CheckpointVector *checkpoints;
+    int last_line;
+
+    // NOTE only set when there is a previous run to resume from
+    CheckpointVector *old_checkpoints;
+    ParseEdit *edit;
+    Checkpoint *start;
+    int old_index;
+    size_t converge_after;
+    int index_shift;
+
+    Checkpoint *converged;
+    size_t converged_offset;
+    int result_shift;
+    int dirty_line;
+
+    // NOTE only set when lexing a chunk, the run stops at end_offset and saves its state there
+    size_t end_offset;
+    Checkpoint *exit;
+    // NOTE only set by the windowed passes, the buffer then starts at this offset of the source
+    size_t window_offset;
+
+    // NOTE hidden #if blocks skipped by the masking, for the stats
+    int num_hidden_blocks;
+};
+
+Checkpoint *CopyCheckpoint(CheckpointVector *to, CheckpointVector *from, Checkpoint *checkpoint, ParseEdit *edit)
+{
+    Checkpoint copy = *checkpoint;
+
+    if(edit)
+    {
+        copy.offset += edit->new_end - edit->old_end;
+        copy.line += edit->new_end_pos.a - edit->old_end_pos.a;
+    }
+
+    if(checkpoint->pound_ifs)
+    {
+        copy.pound_ifs = PushArray(to->arena, PoundIfParsing, 1);
+        *copy.pound_ifs = *checkpoint->pound_ifs;
+    }
+
+    copy.stack_start = to->stacks.len;
+    for(int i = 0; i < checkpoint->stack_len; ++i)
+    {
+        CharPosition p = from->stacks.array[checkpoint->stack_start + i];
+        MapPosition(edit, p.pair, &p.pair);
+        p.offset = MapOffset(edit, p.offset);
+        Insert(&to->stacks, p);
+    }
+
+    Insert(to, copy);
+
+    return &to->array[to->len - 1];
+}
+
+void StartRun(IncrementalRun *run, CheckpointVector *checkpoints, CheckpointVector *old_checkpoints,
+              ParseEdit *edit, int dirty_line, size_t converge_after)
+{
+    *run = {};
+    run->checkpoints = checkpoints;
+    run->last_line = 1;
+
+    if(!old_checkpoints || !edit)
+    {
+        return;
+    }
+
+    run->old_checkpoints = old_checkpoints;
+    run->edit = edit;
+    run->converge_after = converge_after;
+    run->dirty_line = dirty_line;
+
+    int start = -1;
+    while(start + 1 < old_checkpoints->len && old_checkpoints->array[start + 1].line <= dirty_line)
+    {
+        start++;
+    }
+
+    // NOTE everything before the start is unchanged
+    for(int i = 0; i <= start; ++i)
+    {
+        CopyCheckpoint(checkpoints, old_checkpoints, &old_checkpoints->array[i], NULL);
+    }
+
+    if(start >= 0)
+    {
+        run->start = &old_checkpoints->array[start];
+        run->last_line = run->start->line;
+    }
+    run->old_index = start + 1;
+}
+
+bool ShouldSaveCheckpoint(IncrementalRun *run, int line)
+{
+    return (run && run->checkpoints && line - run->last_line >= CHECKPOINT_INTERVAL);
+}
+
+Checkpoint *SaveCheckpoint(IncrementalRun *run, size_t offset, int line)
+{
+    Checkpoint checkpoint = {};
+    checkpoint.offset = offset;
+    checkpoint.line = line;
+    checkpoint.stack_start = run->checkpoints->stacks.len;
+
+    Insert(run->checkpoints, checkpoint);
+    run->last_line = line;
+
+    return &run->checkpoints->array[run->checkpoints->len - 1];
+}
+
+// NOTE returns the checkpoint of the previous run this line start corresponds to, if any
+Checkpoint *FindConvergence(IncrementalRun *run, size_t offset, int line)
+{
+    if(!run || !run->edit || offset < run->converge_after)
+    {
+        return NULL;
+    }
+
+    CheckpointVector *old = run->old_checkpoints;
+    int old_line = line - (run->edit->new_end_pos.a - run->edit->old_end_pos.a);
+    while(run->old_index < old->len && old->array[run->old_index].line < old_line)
+    {
+        run->old_index++;
+    }
+
+    if(run->old_index < old->len && old->array[run->old_index].line == old_line)
+    {
+        return &old->array[run->old_index];
+    }
+
+    return NULL;
+}
+
+void Converge(IncrementalRun *run, Checkpoint *old, size_t offset)
+{
+    run->converged = old;
+    run->converged_offset = offset;
+}
+
+// NOTE copies the checkpoints of the previous run after the convergence point
+void CopyConvergedCheckpoints(IncrementalRun *run, int result_shift)
+{
+    run->result_shift = result_shift;
+    for(int i = run->old_index; i < run->old_checkpoints->len; ++i)
+    {
+        Checkpoint *checkpoint = CopyCheckpoint(run->checkpoints, run->old_checkpoints,
+                                                &run->old_checkpoints->array[i], run->edit);
+        checkpoint->result_len += result_shift;
+        checkpoint->generic_index += run->index_shift;
+    }
+}
+
+void SaveStack(IncrementalRun *run, Checkpoint *checkpoint, CharPosition *stack, int len)
+{
+    checkpoint->stack_len = len;
+    for(int i = 0; i < len; ++i)
+    {
+        Insert(&run->checkpoints->stacks, stack[i]);
+    }
+}
+
+bool IsSameStack(IncrementalRun *run, Checkpoint *old, CharPosition *stack, int len)
+{
+    if(old->stack_len != len)
+    {
+        return false;
+    }
+
+    CharPosition *a = run->old_checkpoints->stacks.array + old->stack_start;
+    for(int i = 0; i < len; ++i)
+    {
+        if(!IsSameCharPosition(run->edit, a[i], stack[i]))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// NOTE the starts of the lines go to line_starts, followed by the length of the buffer
+PairVector ParseGenericFile(const char *buffer, size_t length, Arena *arena, OffsetVector *line_starts,
+                            CharPositionVector generics = {}, CharPair generic_pair = {},
+                            IncrementalRun *run = NULL, PairVector *old_result = NULL,
+                            OffsetVector *old_line_starts = NULL)
+{
+    Scanner scanner;
+    int classes = SCAN_BRACKET | SCAN_NEWLINE | (generics.len > 0 ? SCAN_ANGLE : 0);
+    StartScanner(&scanner, buffer, length, classes);
+
+    // NOTE every pair needs two brackets, so the result can't be larger than the number of
+    // brackets, after a change it is about as large as before
+    PairVector result;
+    if(run && run->edit)
+    {
+        result = MakePairVector(arena, old_result->len + 32);
+        *line_starts = MakeOffsetVector(arena, old_line_starts->len + 64);
+    }
+    else
+    {
+        size_t newlines = 0;
+        result = MakePairVector(arena, ScanCount(&scanner, classes & ~SCAN_NEWLINE, &newlines) / 2 + 1);
+        *line_starts = MakeOffsetVector(arena, (int)newlines + 2);
+    }
+
+    CharPositionVector s = MakeVector(arena, 64);
+
+    IntPair cur_pos = { 1, 1 };
+
+    int level = 0;
+    int generic_i = 0;
+
+    const char *c = buffer;
+    if(!run || !run->start)
+    {
+        Insert(line_starts, 0);
+    }
+
+    if(run && run->start)
+    {
+        Checkpoint *start = run->start;
+        Reserve(&result, start->result_len);
+        memcpy(result.open, old_result->open, sizeof(uint32_t) * start->result_len);
+        memcpy(result.close, old_result->close, sizeof(uint32_t) * start->result_len);
+        memcpy(result.level, old_result->level, sizeof(uint16_t) * start->result_len);
+        result.len = start->result_len;
+        memcpy(line_starts->array, old_line_starts->array, sizeof(uint32_t) * start->line);
+        line_starts->len = start->line;
+        for(int i = 0; i < start->stack_len; ++i)
+        {
+            PushCharPosition(&s, run->old_checkpoints->stacks.array[start->stack_start + i]);
+        }
+
+        c = buffer + start->offset;
+        cur_pos.a = start->line;
+        level = start->level;
+        generic_i = start->generic_index;
+    }
+
+    for(; *c != '\0'; c++)
+    {
+        IntPair current_generic = {};
+        if(generic_i < generics.len)
+        {
+            current_generic = generics.array[generic_i].pair;
+        }
+        if(*c == '\n')
+        {
+            cur_pos.a++;
+            cur_pos.b = 1;
+            Insert(line_starts, (uint32_t)(c + 1 - buffer));
+
+            if(run)
+            {
+                size_t offset = c + 1 - buffer;
+                Checkpoint *old = FindConvergence(run, offset, cur_pos.a);
+                if(old && old->level == level && old->generic_index + run->index_shift == generic_i &&
+                   IsSameStack(run, old, s.array, s.len))
+                {
+                    Converge(run, old, offset);
+                    break;
+                }
+                if(ShouldSaveCheckpoint(run, cur_pos.a))
+                {
+                    Checkpoint *checkpoint = SaveCheckpoint(run, offset, cur_pos.a);
+                    checkpoint->level = level;
+                    checkpoint->generic_index = generic_i;
+                    checkpoint->result_len = result.len;
+                    SaveStack(run, checkpoint, s.array, s.len);
+                }
+            }
+        }
+        else
+        {
+            CharPosition p = {};
+            p.c = *c;
+            p.pair = cur_pos;
+            p.offset = (uint32_t)(c - buffer);
+            if(*c == '(' || *c == '[' || *c == '{' ||
+               (current_generic.a == cur_pos.a && current_generic.b == cur_pos.b
+                && *c == generic_pair.a))
+            {
+                p.level = level;
+                PushCharPosition(&s, p);
+                level++;
+                if(current_generic.a == cur_pos.a && current_generic.b == cur_pos.b)
+                {
+                    generic_i++;
+                }
+            }
+            else if(p.c == ')' || p.c == ']' || p.c == '}' ||
+                    (current_generic.a == cur_pos.a && current_generic.b == cur_pos.b
+                     && *c == generic_pair.b))
+            {
+                char opening_bracket = GetMatchingPair(*c);
+                level = InsertPair(&result, &s, level, opening_bracket, p);
+                if(current_generic.a == cur_pos.a && current_generic.b == cur_pos.b)
+                {
+                    generic_i++;
+                }
+            }
+            cur_pos.b++;
+        }
+
+        // NOTE nothing happens on the other characters
+        const char *next = ScanNext(&scanner, c + 1, classes);
+        cur_pos.b += next - (c + 1);
+        c = next - 1;
+    }
+
+    if(run && run->converged)
+    {
+        int result_shift = result.len - run->converged->result_len;
+        Reserve(&result, result.len + old_result->len - run->converged->result_len);
+        for(int i = run->converged->result_len; i < old_result->len; ++i)
+        {
+            result.open[result.len] = MapOffset(run->edit, old_result->open[i]);
+            result.close[result.len] = MapOffset(run->edit, old_result->close[i]);
+            result.level[result.len] = old_result->level[i];
+            result.len++;
+        }
+        CopyConvergedCheckpoints(run, result_shift);
+
+        // NOTE the line of the convergence was just added, the old sentinel is not copied
+        Reserve(line_starts, line_starts->len + old_line_starts->len - run->converged->line);
+        for(int i = run->converged->line; i + 1 < old_line_starts->len; ++i)
+        {
+            line_starts->array[line_starts->len++] = MapOffset(run->edit, old_line_starts->array[i]);
+        }
+    }
+    Insert(line_starts, (uint32_t)length);
+
+    return result;
+}
+
+// NOTE indices in the angle bracket vector of the '<' that are not matched yet
+struct OpenAngleBrackets
+{
+    int *array;
+    int len;
+    int size;
+    Arena *arena;
+};
+
+void Push(OpenAngleBrackets *open, int index)
+{
+    if(open->len == open->size)
+    {
+        int size = open->size ? open->size * 2 : 64;
+        int *array = PushArray(open->arena, int, size);
+        if(open->len)
+        {
+            memcpy(array, open->array, open->len * sizeof(int));
+        }
+        open->array = array;
+        open->size = size;
+    }
+    open->array[open->len++] = index;
+}
+
+// NOTE removes every '<' that is still open from the vector, only the part after the first
+// one is moved so each bracket is moved at most once after it was inserted
+void DropOpenAngleBrackets(CharPositionVector *vec, OpenAngleBrackets *open)
+{
+    if(open->len == 0)
+    {
+        return;
+    }
+
+    int to = open->array[0];
+    int next_open = 0;
+    for(int from = to; from < vec->len; ++from)
+    {
+        if(next_open < open->len && open->array[next_open] == from)
+        {
+            next_open++;
+        }
+        else
+        {
+            vec->array[to++] = vec->array[from];
+        }
+    }
+
+    vec->len = to;
+    open->len = 0;
+}
+
+void CContinueString(StringParsingInfo *info, const char *c)
+{
+    if((info->current_string == '\'' && *c == '\'') &&
+       (*(c - 1) != '\\' || *(c - 2) == '\\'))
+    {
+        info->current_string = '\0';
+    }
+    else if((info->current_string == '\"' && *c == '\"') &&
+            (*(c - 1) != '\\' || *(c - 2) == '\\'))
+    {
+        info->current_string = '\0';
+    }
+}
+
+bool CCheckCloseMultilineComment(const char *c, const char *multiline_comment)
+{
+    return (*c == '/' && *(c - 1) == '*' && c != multiline_comment + 1);
+}
+
+bool CCheckStartMultilineComment(const char *c, const char *buffer, const char *last_closed_comment)
+{
+    return (last_closed_comment != (c - 1) && *c == '*' && c != buffer && *(c - 1) == '/');
+}
+
+bool CCheckStartLineComment(const char *c, const char *buffer, const char *last_closed_comment)
+{
+    return (last_closed_comment != (c - 1) && *c == '/' && c != buffer && *(c - 1) == '/');
+}
+
+enum PoundIfDirectiveKind
+{
+    DIRECTIVE_NONE,
+    DIRECTIVE_OPEN,
+    DIRECTIVE_BRANCH,
+    DIRECTIVE_END,
+};
+
+enum PoundIfCondition
+{
+    CONDITION_NONE,
+    CONDITION_EXPRESSION,
+    CONDITION_DEFINED,
+    CONDITION_NOT_DEFINED,
+    CONDITION_ALWAYS,
+};
+
+struct PoundIfDirectiveName
+{
+    const char *name;
+    int length;
+    PoundIfDirectiveKind kind;
+    PoundIfCondition condition;
+};
+
+const PoundIfDirectiveName pound_if_directives[] =
+{
+    {"if", 2, DIRECTIVE_OPEN, CONDITION_EXPRESSION},
+    {"ifdef", 5, DIRECTIVE_OPEN, CONDITION_DEFINED},
+    {"ifndef", 6, DIRECTIVE_OPEN, CONDITION_NOT_DEFINED},
+    {"elif", 4, DIRECTIVE_BRANCH, CONDITION_EXPRESSION},
+    {"elifdef", 7, DIRECTIVE_BRANCH, CONDITION_DEFINED},
+    {"elifndef", 8, DIRECTIVE_BRANCH, CONDITION_NOT_DEFINED},
+    {"else", 4, DIRECTIVE_BRANCH, CONDITION_ALWAYS},
+    {"endif", 5, DIRECTIVE_END, CONDITION_NONE},
+};
+
+#define NUM_POUND_IF_DIRECTIVES (int)(sizeof(pound_if_directives) / sizeof(pound_if_directives[0]))
+
+// NOTE value is 0 when the condition is false, 1 when it's true and 2 when it's unknown
+struct PoundIfDirective
+{
+    PoundIfDirectiveKind kind;
+    char value;
+};
+
+bool IsIdentifierChar(char c)
+{
+    return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_');
+}
+
+const char *SkipBlanks(const char *c)
+{
+    while(*c == ' ' || *c == '\t')
+    {
+        c++;
+    }
+    return c;
+}
+
+const char *SkipIdentifier(const char *c)
+{
+    while(IsIdentifierChar(*c))
+    {
+        c++;
+    }
+    return c;
+}
+
+bool IsLineStart(const char *c, const char *buffer)
+{
+    while(c > buffer && (*(c - 1) == ' ' || *(c - 1) == '\t'))
+    {
+        c--;
+    }
+    return (c == buffer || *(c - 1) == '\n');
+}
+
+// NOTE returns the value of the macro, or only whether it is defined
+char LookupDefine(PoundIfDefines *defines, const char *name, int length, bool only_defined)
+{
+    for(int i = 0; i < defines->count; ++i)
+    {
+        const char *define = defines->names[i];
+        bool undefined = (define[0] == '!');
+        if(undefined)
+        {
+            define++;
+        }
+
+        if(strncmp(define, name, length) != 0 || (define[length] != '\0' && define[length] != '='))
+        {
+            continue;
+        }
+
+        if(undefined)
+        {
+            return 0;
+        }
+        if(only_defined || define[length] == '\0')
+        {
+            return 1;
+        }
+
+        const char *value = define + length + 1;
+        char *end;
+        long number = strtol(value, &end, 0);
+        return (end != value && *end == '\0') ? (number != 0) : 2;
+    }
+
+    return 2;
+}
+
+// NOTE only a number, a macro or defined(MACRO), optionally negated, can be evaluated
+char EvaluatePoundIf(const char *c, PoundIfDefines *defines)
+{
+    bool negate = false;
+    c = SkipBlanks(c);
+    while(*c == '!')
+    {
+        negate = !negate;
+        c = SkipBlanks(c + 1);
+    }
+
+    const char *name = c;
+    c = SkipIdentifier(c);
+    int length = c - name;
+
+    char value = 2;
+    if(length == 0)
+    {
+        return 2;
+    }
+    else if(*name >= '0' && *name <= '9')
+    {
+        char *end;
+        long number = strtol(name, &end, 0);
+        for(; end < c; end++)
+        {
+            if(*end != 'u' && *end != 'U' && *end != 'l' && *end != 'L')
+            {
+                return 2;
+            }
+        }
+        value = (number != 0);
+    }
+    else if(length == 7 && memcmp(name, "defined", 7) == 0)
+    {
+        c = SkipBlanks(c);
+        bool parenthesis = (*c == '(');
+        if(parenthesis)
+        {
+            c = SkipBlanks(c + 1);
+        }
+
+        name = c;
+        c = SkipIdentifier(c);
+        length = c - name;
+
+        if(parenthesis)
+        {
+            c = SkipBlanks(c);
+            if(*c != ')')
+            {
+                return 2;
+            }
+            c++;
+        }
+        value = (length > 0) ? LookupDefine(defines, name, length, true) : 2;
+    }
+    else
+    {
+        value = LookupDefine(defines, name, length, false);
+    }
+
+    // NOTE anything but a comment after it is an expression we don't handle
+    c = SkipBlanks(c);
+    if(*c != '\n' && *c != '\r' && *c != '\0' && !(*c == '/' && (*(c + 1) == '/' || *(c + 1) == '*')))
+    {
+        return 2;
+    }
+
+    return (value != 2 && negate) ? !value : value;
+}
+
+// NOTE c is a '#', the directive name is looked up once, the characters after it are only
+// read for the condition
+PoundIfDirective ParsePoundIfDirective(const char *c, PoundIfDefines *defines)
+{
+    PoundIfDirective directive = {};
+
+    const char *name = SkipBlanks(c + 1);
+    c = SkipIdentifier(name);
+    int length = c - name;
+
+    for(int i = 0; i < NUM_POUND_IF_DIRECTIVES; ++i)
+    {
+        const PoundIfDirectiveName *d = &pound_if_directives[i];
+        if(d->length != length || memcmp(d->name, name, length) != 0)
+        {
+            continue;
+        }
+
+        directive.kind = d->kind;
+        if(d->condition == CONDITION_EXPRESSION)
+        {
+            directive.value = EvaluatePoundIf(c, defines);
+        }
+        else if(d->condition == CONDITION_DEFINED || d->condition == CONDITION_NOT_DEFINED)
+        {
+            name = SkipBlanks(c);
+            length = SkipIdentifier(name) - name;
+            directive.value = (length > 0) ? LookupDefine(defines, name, length, true) : 2;
+            if(d->condition == CONDITION_NOT_DEFINED && directive.value != 2)
+            {
+                directive.value = !directive.value;
+            }
+        }
+        else
+        {
+            directive.value = 1;
+        }
+        break;
+    }
+
+    return directive;
+}
+
+int GetPoundIfState(PoundIfParsing *parser, int level)
+{
+    if(level >= POUND_IF_MAX_LEVELS)
+    {
+        return POUND_IF_UNKNOWN;
+    }
+
+    uint64_t bit = (uint64_t)1 << (level & 63);
+    return (((parser->shown[level >> 6] & bit) ? POUND_IF_SHOWN : 0) |
+            ((parser->settled[level >> 6] & bit) ? POUND_IF_SETTLED : 0));
+}
+
+void SetPoundIfState(PoundIfParsing *parser, int level, int state)
+{
+    if(level >= POUND_IF_MAX_LEVELS)
+    {
+        return;
+    }
+
+    uint64_t bit = (uint64_t)1 << (level & 63);
+    parser->shown[level >> 6] &= ~bit;
+    parser->settled[level >> 6] &= ~bit;
+    if(state & POUND_IF_SHOWN)
+    {
+        parser->shown[level >> 6] |= bit;
+    }
+    if(state & POUND_IF_SETTLED)
+    {
+        parser->settled[level >> 6] |= bit;
+    }
+}
+
+// NOTE once a chain is unknown all of its branches are shown, even the ones that are false
+int NextPoundIfState(int state, char value)
+{
+    if(state == POUND_IF_TAKEN || state == POUND_IF_DONE)
+    {
+        return POUND_IF_DONE;
+    }
+    else if(state == POUND_IF_UNKNOWN)
+    {
+        return POUND_IF_UNKNOWN;
+    }
+
+    return (value == 1) ? POUND_IF_TAKEN : ((value == 0) ? POUND_IF_PENDING : POUND_IF_UNKNOWN);
+}
+
+void PushPoundIf(PoundIfParsing *parser, int state)
+{
+    SetPoundIfState(parser, parser->level, state);
+    if(!(GetPoundIfState(parser, parser->level) & POUND_IF_SHOWN))
+    {
+        parser->hidden_levels++;
+    }
+    parser->level++;
+    if(parser->level > parser->max_level)
+    {
+        parser->max_level = parser->level;
+    }
+}
+
+int PopPoundIf(PoundIfParsing *parser)
+{
+    parser->level--;
+    if(parser->level < parser->min_level)
+    {
+        parser->min_level = parser->level;
+    }
+    int state = GetPoundIfState(parser, parser->level);
+    if(!(state & POUND_IF_SHOWN))
+    {
+        parser->hidden_levels--;
+    }
+    SetPoundIfState(parser, parser->level, POUND_IF_PENDING);
+    return state;
+}
+
+bool IsPoundIfHidden(PoundIfParsing *parser)
+{
+    return (parser->hidden_levels > 0);
+}
+
+// NOTE the branch that ends is closed right away and the one that starts is opened at the end
+// of the line, an #else or #endif without an #if is ignored
+void StartPoundIfDirective(PoundIfParsing *parser, PoundIfDirective directive)
+{
+    if(directive.kind == DIRECTIVE_OPEN)
+    {
+        parser->pending = true;
+        parser->pending_state = NextPoundIfState(POUND_IF_PENDING, directive.value);
+    }
+    else if(directive.kind != DIRECTIVE_NONE && parser->level > 0)
+    {
+        int state = PopPoundIf(parser);
+        if(directive.kind == DIRECTIVE_BRANCH)
+        {
+            // NOTE the branch depends on the state of a level the chunk doesn't know
+            if(parser->level < parser->base_level)
+            {
+                parser->base_branched = true;
+            }
+            parser->pending = true;
+            parser->pending_state = NextPoundIfState(state, directive.value);
+        }
+    }
+}
+
+void FinishPoundIfLine(PoundIfParsing *parser)
+{
+    if(parser->pending)
+    {
+        PushPoundIf(parser, parser->pending_state);
+        parser->pending = false;
+    }
+}
+
+// NOTE a chunk that doesn't know the #ifs it starts in is lexed as if it was inside
+// POUND_IF_BASE_LEVELS taken branches, as long as it can't be hidden that's all that matters
+#define POUND_IF_BASE_LEVELS 64
+
+void StartBasePoundIfs(PoundIfParsing *parser)
+{
+    *parser = {};
+    for(int level = 0; level < POUND_IF_BASE_LEVELS; ++level)
+    {
+        SetPoundIfState(parser, level, POUND_IF_TAKEN);
+    }
+    parser->level = POUND_IF_BASE_LEVELS;
+    parser->base_level = POUND_IF_BASE_LEVELS;
+    parser->min_level = POUND_IF_BASE_LEVELS;
+    parser->max_level = POUND_IF_BASE_LEVELS;
+}
+
+// NOTE turns the state of a chunk lexed from the base levels into the real one given the
+// state the chunk really starts in, which must not be hidden, fails when the chunk did
+// something that depends on the levels it didn't know: starting another branch of one that
+// isn't simply taken, closing more of them than there are or going past the last level
+bool ComposePoundIfs(PoundIfParsing *entry, PoundIfParsing *chunk, PoundIfParsing *result)
+{
+    int shift = entry->level - chunk->base_level;
+    if(entry->hidden_levels > 0 || entry->pending ||
+       chunk->min_level + shift < 0 || chunk->max_level >= POUND_IF_MAX_LEVELS ||
+       chunk->max_level + shift >= POUND_IF_MAX_LEVELS)
+    {
+        return false;
+    }
+
+    for(int level = chunk->min_level + shift; level < entry->level && chunk->base_branched; ++level)
+    {
+        if(GetPoundIfState(entry, level) != POUND_IF_TAKEN)
+        {
+            return false;
+        }
+    }
+
+    PoundIfParsing composed = {};
+    for(int level = 0; level < chunk->min_level + shift; ++level)
+    {
+        SetPoundIfState(&composed, level, GetPoundIfState(entry, level));
+    }
+    for(int level = chunk->min_level; level < chunk->level; ++level)
+    {
+        SetPoundIfState(&composed, level + shift, GetPoundIfState(chunk, level));
+    }
+    composed.level = chunk->level + shift;
+    composed.hidden_levels = chunk->hidden_levels;
+    composed.pending = chunk->pending;
+    composed.pending_state = chunk->pending_state;
+
+    *result = composed;
+    return true;
+}
+
+// NOTE blanks the hidden code from c on into out up to the next '#' at the start of a line
+// that can change what is hidden, or the end, the lines are kept so the positions stay the same
+const char *SkipHiddenCode(Scanner *scanner, const char *c, const char *buffer, PoundIfDefines *defines,
+                           char *out, int *lines)
+{
+    const char *start = c;
+    for(;;)
+    {
+        c = ScanBlank(scanner, c, SCAN_NEWLINE, SCAN_POUND, out + (c - start), lines);
+        if(c == scanner->end || *c != '#' ||
+           (IsLineStart(c, buffer) && ParsePoundIfDirective(c, defines).kind != DIRECTIVE_NONE))
+        {
+            return c;
+        }
+        out[c - start] = ' ';
+        c++;
+    }
+}
+
+// NOTE the stats of a run are only collected with --stats, everything else sees a NULL RunStats
+// and skips them, the counters that can be are computed from the results after the run
+#define PHASE_READ 0
+#define PHASE_MASK 1
+#define PHASE_ANGLE 2
+#define PHASE_BRACKETS 3
+#define PHASE_OUTPUT 4
+#define PHASE_CACHE 5
+#define NUM_PHASES 6
+
+const char *phase_names[NUM_PHASES] = {"read", "mask", "angle", "brackets", "output", "cache"};
+
+struct RunStats
+{
+    bool phase_ran[NUM_PHASES];
+    uint64_t phase_ns[NUM_PHASES];
+    size_t phase_bytes[NUM_PHASES];
+
+    int num_pairs;
+    int max_depth;
+    int template_candidates;
+    int templates_rejected;
+    int hidden_blocks;
+    int allocations;
+    int num_chunks;
+    int fallback;
+    bool cache_hit;
+};
+
+uint64_t GetNanoseconds()
+{
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+uint64_t StartPhase(RunStats *stats)
+{
+    return stats ? GetNanoseconds() : 0;
+}
+
+void FinishPhase(RunStats *stats, int phase, uint64_t start, size_t bytes)
+{
+    if(stats)
+    {
+        stats->phase_ran[phase] = true;
+        stats->phase_ns[phase] += GetNanoseconds() - start;
+        stats->phase_bytes[phase] += bytes;
+    }
+}
+
+// NOTE an incremental run only scans from the checkpoint it resumes from to where it converges
+void FinishPhase(RunStats *stats, int phase, uint64_t start, IncrementalRun *run, size_t length)
+{
+    if(stats)
+    {
+        size_t from = run->start ? run->start->offset : 0;
+        size_t to = run->converged ? run->converged_offset : length;
+        FinishPhase(stats, phase, start, (to > from) ? to - from : 0);
+    }
+}
+
+// NOTE: with rainbow_latency_budget_ms a run that is not going to make it in time gives up on
+// parts of the highlighting in steps, the levels only go up during a run. The deadline is
+// checked at the phase boundaries and after every window of the fused pass, the end of the
+// parse is projected from how fast the part behind it went
+#define BUDGET_EXACT 0
+#define BUDGET_NO_BACKGROUNDS 1
+#define BUDGET_NO_TEMPLATES 2
+#define BUDGET_VIEWPORT 3
+
+const char *budget_level_names[] = {"exact", "no backgrounds", "no templates", "viewport only"};
+
+// NOTE the first window is slower, the projection waits for this much of the parse or a
+// sixteenth of it, the deadline is checked anyway
+#define BUDGET_MIN_SAMPLE (1024 * 1024)
+
+// NOTE the projection goes from parse_start and start_done, the fused pass moves them up when
+// it stops checking the <> so the part after goes faster
+struct LatencyBudget
+{
+    uint32_t ms;
+    uint64_t deadline;
+    uint64_t parse_start;
+    size_t start_done;
+    int level;
+};
+
+// NOTE ms is what is left of the budget when the run starts, 0 is no budget
+LatencyBudget *StartBudget(LatencyBudget *budget, uint32_t ms)
+{
+    if(ms == 0)
+    {
+        return NULL;
+    }
+
+    *budget = {};
+    budget->ms = ms;
+    budget->deadline = GetNanoseconds() + (uint64_t)ms * 1000000;
+    budget->parse_start = GetNanoseconds();
+
+    return budget;
+}
+
+uint32_t GetBudgetLeft(LatencyBudget *budget)
+{
+    uint64_t now = GetNanoseconds();
+    return (budget->deadline > now + 1000000) ? (uint32_t)((budget->deadline - now) / 1000000) : 1;
+}
+
+// NOTE done out of total is the part of the parse behind it, a parse over the budget skips the
+// backgrounds level, they are left out anyway when it's the output that is late. The total is
+// 0 when the length is not known yet, then it only falls back once the deadline is past and
+// never to the viewport
+int CheckBudget(LatencyBudget *budget, size_t done, size_t total)
+{
+    if(!budget)
+    {
+        return BUDGET_EXACT;
+    }
+
+    int max_level = (total > 0) ? BUDGET_VIEWPORT : BUDGET_NO_TEMPLATES;
+    if(budget->level >= max_level)
+    {
+        return budget->level;
+    }
+
+    uint64_t now = GetNanoseconds();
+    uint64_t end = now;
+    size_t sample = (done > budget->start_done) ? done - budget->start_done : 0;
+    if(total > done && sample > 0 && (sample >= total / 16 || sample >= BUDGET_MIN_SAMPLE))
+    {
+        end += (uint64_t)((double)(now - budget->parse_start) * (total - done) / (done - budget->start_done));
+    }
+    if(end > budget->deadline)
+    {
+        budget->level = (budget->level < BUDGET_NO_TEMPLATES) ? BUDGET_NO_TEMPLATES : budget->level + 1;
+    }
+
+    return budget->level;
+}
+
+// NOTE the backgrounds are left out when less than a quarter of the budget is left for the
+// output, the parse doesn't know how long it will take
+bool IsBudgetShort(LatencyBudget *budget)
+{
+    if(!budget)
+    {
+        return false;
+    }
+
+    uint64_t now = GetNanoseconds();
+    return (budget->deadline < now || budget->deadline - now < (budget->deadline - budget->parse_start) / 4);
+}
+
+// NOTE the directory of the socket and the name of the socket in it
+bool SplitSocketPath(const char *socket_path, char *directory, size_t size, const char **name)
+{
+    if(strlen(socket_path) >= size)
+    {
+        return false;
+    }
+    strcpy(directory, socket_path);
+
+    *name = socket_path;
+    char *slash = strrchr(directory, '/');
+    if(slash)
+    {
+        *name += slash - directory + 1;
+        slash[slash == directory ? 1 : 0] = 0;
+    }
+    else
+    {
+        strcpy(directory, ".");
+    }
+
+    return true;
+}
+
+// NOTE the server gets the buffers and kakoune runs what it sends back, so the socket and the
+// job slots only go in a directory no other user can write to, like $TMPDIR/kakoune-$USER is
+// for kakoune: it's made when it's missing and has to be ours with no group or other bits
+bool IsPrivateSocketDirectory(const char *socket_path)
+{
+    char directory[4096];
+    const char *name;
+    if(!SplitSocketPath(socket_path, directory, sizeof(directory), &name))
+    {
+        return false;
+    }
+
+    mkdir(directory, 0700);
+    struct stat directory_info;
+    return (lstat(directory, &directory_info) == 0 && S_ISDIR(directory_info.st_mode) &&
+            directory_info.st_uid == geteuid() && (directory_info.st_mode & 077) == 0);
+}
+
+// NOTE: kakoune starts a run for every idle event in the background, during fast typing they
+// pile up, so every buffer has a job slot with the latest timestamp a run was started for.
+// A run of an older timestamp is superseded, it stops at the next phase and prints nothing.
+// The slot is a small file next to the server socket of the session, it's mapped so checking
+// it is only a load
+#define JOB_SLOT_SUFFIX ".job"
+
+struct JobSlot
+{
+    uint64_t *latest;
+    uint64_t timestamp;
+};
+
+// NOTE FNV-1a, only to turn the buffile into a file name
+uint64_t HashString(const char *string)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for(const char *c = string; *c; ++c)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+// NOTE the slot of a buffer is <socket>-<hash of the buffile>.job
+bool GetJobSlotPath(char *path, size_t size, const char *socket_path, const char *buffile)
+{
+    int length = snprintf(path, size, "%s-%016llx" JOB_SLOT_SUFFIX, socket_path,
+                          (unsigned long long)HashString(buffile));
+    return length > 0 && (size_t)length < size;
+}
+
+// NOTE when the slot can't be opened the run is never superseded, it's only used in the private
+// directory of the socket and when it's a plain file of ours that is not linked anywhere else
+void OpenJobSlot(JobSlot *slot, const char *socket_path, const char *buffile)
+{
+    *slot = {};
+
+    char path[4096];
+    if(!GetJobSlotPath(path, sizeof(path), socket_path, buffile) || !IsPrivateSocketDirectory(socket_path))
+    {
+        return;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if(fd < 0)
+    {
+        return;
+    }
+
+    struct stat file_info;
+    if(fstat(fd, &file_info) == 0 && S_ISREG(file_info.st_mode) && file_info.st_uid == geteuid() &&
+       file_info.st_nlink == 1 &&
+       (file_info.st_size >= (off_t)sizeof(uint64_t) || ftruncate(fd, sizeof(uint64_t)) == 0))
+    {
+        void *data = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(data != MAP_FAILED)
+        {
+            slot->latest = (uint64_t *)data;
+        }
+    }
+    close(fd);
+}
+
+// NOTE makes the timestamp the latest one unless a newer one is already there, then the run is
+// superseded before it started
+bool ClaimJobSlot(JobSlot *slot, const char *timestamp)
+{
+    slot->timestamp = strtoull(timestamp, NULL, 10);
+    if(!slot->latest)
+    {
+        return true;
+    }
+
+    uint64_t latest = __atomic_load_n(slot->latest, __ATOMIC_ACQUIRE);
+    while(latest < slot->timestamp)
+    {
+        if(__atomic_compare_exchange_n(slot->latest, &latest, slot->timestamp, true,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            return true;
+        }
+    }
+
+    return latest == slot->timestamp;
+}
+
+bool IsSuperseded(JobSlot *slot)
+{
+    return slot && slot->latest && __atomic_load_n(slot->latest, __ATOMIC_ACQUIRE) > slot->timestamp;
+}
+
+void Free(JobSlot *slot)
+{
+    if(slot->latest)
+    {
+        munmap(slot->latest, sizeof(uint64_t));
+    }
+    *slot = {};
+}
+
+// NOTE the timestamps start again from 0 when a buffer is opened again, so the slots go away with
+// the buffer and the ones left from an earlier session with the same name are removed
+void RemoveJobSlot(const char *socket_path, const char *buffile)
+{
+    char path[4096];
+    if(GetJobSlotPath(path, sizeof(path), socket_path, buffile))
+    {
+        unlink(path);
+    }
+}
+
+void RemoveJobSlots(const char *socket_path)
+{
+    char directory[4096];
+    const char *name;
+    if(!SplitSocketPath(socket_path, directory, sizeof(directory), &name))
+    {
+        return;
+    }
+
+    DIR *dir = opendir(directory);
+    if(!dir)
+    {
+        return;
+    }
+
+    size_t name_length = strlen(name);
+    size_t suffix_length = strlen(JOB_SLOT_SUFFIX);
+    size_t slot_length = name_length + 1 + 16 + suffix_length;
+    while(dirent *entry = readdir(dir))
+    {
+        if(strlen(entry->d_name) == slot_length && strncmp(entry->d_name, name, name_length) == 0 &&
+           entry->d_name[name_length] == '-' &&
+           strcmp(entry->d_name + slot_length - suffix_length, JOB_SLOT_SUFFIX) == 0)
+        {
+            char path[sizeof(directory) + 256];
+            snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+// NOTE mapped_size is only set when the data is a mapped file
+struct String
+{
+    char *data;
+    size_t length;
+    size_t mapped_size;
+};
+
+// NOTE result is ordered by the closing brackets, the index orders the pairs by their opening
+// ones and links every pair to the innermost one around it, the pairs never cross so that's an
+// interval tree where the pairs around a position are the parents of the last one opened before it
+struct PairIndex
+{
+    // NOTE pair numbers, the indices of the pairs in result
+    int *by_open;
+    int *parent;
+    int len;
+    bool built;
+};
+
+// NOTE everything a run keeps around so that the next one can resume from its checkpoints,
+// it all lives in the arena so the vectors point to it and the state can't be moved
+struct ParseState
+{
+    Arena arena;
+
+    char *masked;
+    CharPositionVector generics;
+    PairVector result;
+
+    // NOTE the offset every line starts at, to turn the offsets of the pairs into positions, with
+    // the length of the buffer after the last one
+    OffsetVector line_starts;
+
+    CheckpointVector mask_checkpoints;
+    CheckpointVector angle_checkpoints;
+    CheckpointVector bracket_checkpoints;
+
+    // NOTE built from result the first time the ranges are printed
+    PairIndex index;
+
+    // NOTE set by the caller for a run with --stats, kept by ResetParseState
+    RunStats *stats;
+    // NOTE set by the runs started from kakoune, the passes stop when a newer run supersedes it
+    JobSlot *job;
+    // NOTE set by the runs with a latency budget, fallback is the level the parse ended at and a
+    // parse that left out the <> or the lines outside the window is not resumed from, fallback_ms
+    // is the budget it fell back under
+    LatencyBudget *budget;
+    int fallback;
+    uint32_t fallback_ms;
+};
+
+// NOTE clears the state for a new run, keeping the memory of the arena
+void ResetParseState(ParseState *state)
+{
+    ResetArena(&state->arena);
+
+    Arena *arena = &state->arena;
+    state->masked = NULL;
+    state->generics = MakeVector(arena, 0);
+    state->result = MakePairVector(arena, 0);
+    state->line_starts = MakeOffsetVector(arena, 0);
+    state->mask_checkpoints = MakeCheckpointVector(arena);
+    state->angle_checkpoints = MakeCheckpointVector(arena);
+    state->bracket_checkpoints = MakeCheckpointVector(arena);
+    state->index = {};
+    state->fallback = BUDGET_EXACT;
+    state->fallback_ms = 0;
+}
+
+void Free(ParseState *state)
+{
+    Free(&state->arena);
+    *state = {};
+}
+
+// NOTE result is in postorder, walking it backwards the stack holds the pairs around the current
+// one, the subtree sizes then give every pair its place in the opening order without sorting
+PairIndex *GetPairIndex(ParseState *state)
+{
+    PairIndex *index = &state->index;
+    if(index->built)
+    {
+        return index;
+    }
+
+    uint32_t *open = state->result.open;
+    int len = state->result.len;
+    index->by_open = (int *)PushSize(&state->arena, (len + 1) * sizeof(int));
+    index->parent = (int *)PushSize(&state->arena, (len + 1) * sizeof(int));
+    index->len = len;
+    index->built = true;
+
+    // NOTE by_open is the stack until the pairs are placed
+    int *stack = index->by_open;
+    int stack_len = 0;
+    for(int i = len - 1; i >= 0; --i)
+    {
+        while(stack_len > 0 && open[stack[stack_len - 1]] > open[i])
+        {
+            stack_len--;
+        }
+        index->parent[i] = stack_len > 0 ? stack[stack_len - 1] : -1;
+        stack[stack_len++] = i;
+    }
+
+    // NOTE the children of a pair come before it, sizes holds the subtree sizes and then the
+    // end of the slots still free for the children, which are placed from the last one
+    int *sizes = PushArray(&state->arena, int, len + 1);
+    for(int i = 0; i < len; ++i)
+    {
+        sizes[i] = 1;
+    }
+    for(int i = 0; i < len; ++i)
+    {
+        if(index->parent[i] >= 0)
+        {
+            sizes[index->parent[i]] += sizes[i];
+        }
+    }
+
+    int root_end = len;
+    for(int i = len - 1; i >= 0; --i)
+    {
+        int *end = index->parent[i] >= 0 ? &sizes[index->parent[i]] : &root_end;
+        int size = sizes[i];
+        int slot = *end - size;
+        *end = slot;
+        index->by_open[slot] = i;
+        sizes[i] = slot + size;
+    }
+
+    return index;
+}
+
+// NOTE the line and column of an offset, lines and columns start at 1
+IntPair GetPosition(ParseState *state, uint32_t offset)
+{
+    uint32_t *line_starts = state->line_starts.array;
+    int low = 0;
+    int high = state->line_starts.len - 1;
+    while(high - low > 1)
+    {
+        int middle = low + (high - low) / 2;
+        if(line_starts[middle] <= offset)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    IntPair pair = { low + 1, (int)(offset - line_starts[low]) + 1 };
+    return pair;
+}
+
+// NOTE the first offset at or after the position pair, the columns past the end of a line are
+// the start of the next one, so that comparing offsets is the same as comparing positions
+uint32_t GetOffset(ParseState *state, IntPair pair)
+{
+    uint32_t *line_starts = state->line_starts.array;
+    int num_lines = state->line_starts.len - 1;
+    if(num_lines < 1 || pair.a < 1)
+    {
+        return 0;
+    }
+    if(pair.a > num_lines)
+    {
+        return line_starts[num_lines];
+    }
+
+    uint32_t start = line_starts[pair.a - 1];
+    uint32_t next = line_starts[pair.a];
+    if(pair.b < 1)
+    {
+        return start;
+    }
+    if((uint32_t)(pair.b - 1) > next - start)
+    {
+        return next;
+    }
+    return start + pair.b - 1;
+}
+
+// NOTE the first slot of by_open whose pair opens at or after offset
+int FindFirstOpen(PairIndex *index, PairVector *result, uint32_t offset)
+{
+    int low = 0;
+    int high = index->len;
+    while(low < high)
+    {
+        int middle = low + (high - low) / 2;
+        if(result->open[index->by_open[middle]] >= offset)
+        {
+            high = middle;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+
+    return low;
+}
+
+// NOTE the innermost pair that opens before slot and closes at or after offset, or -1
+int FindEnclosingPair(PairIndex *index, PairVector *result, int slot, uint32_t offset)
+{
+    int n = slot > 0 ? index->by_open[slot - 1] : -1;
+    while(n >= 0 && result->close[n] < offset)
+    {
+        n = index->parent[n];
+    }
+
+    return n;
+}
+
+int ComparePairNumbers(const void *a, const void *b)
+{
+    int n_a = *(const int *)a;
+    int n_b = *(const int *)b;
+    return (n_a < n_b) - (n_a > n_b);
+}
+
+// NOTE the pairs with something in [top, bottom): the ones opened in there and the ones around
+// top, in the order of result from the end, returns how many were written to pairs
+int FindVisiblePairs(PairIndex *index, PairVector *result, uint32_t top, uint32_t bottom, int *pairs)
+{
+    int first = FindFirstOpen(index, result, top);
+    int count = 0;
+    for(int slot = first; slot < index->len && result->open[index->by_open[slot]] < bottom; ++slot)
+    {
+        pairs[count++] = index->by_open[slot];
+    }
+    for(int n = FindEnclosingPair(index, result, first, top); n >= 0; n = index->parent[n])
+    {
+        pairs[count++] = n;
+    }
+
+    qsort(pairs, count, sizeof(int), ComparePairNumbers);
+    return count;
+}
+
+bool IsSamePoundIfs(PoundIfParsing *a, PoundIfParsing *b)
+{
+    return (a->level == b->level && a->hidden_levels == b->hidden_levels &&
+            a->pending == b->pending &&
+            memcmp(a->shown, b->shown, sizeof(a->shown)) == 0 &&
+            memcmp(a->settled, b->settled, sizeof(a->settled)) == 0);
+}
+
+void ResumeAngleBrackets(IncrementalRun *run, CharPositionVector *vec, int *settled_len,
+                         OpenAngleBrackets *open, CharPositionVector *old_vec)
+{
+    Checkpoint *start = run->start;
+    for(int i = 0; i < start->result_len; ++i)
+    {
+        Insert(vec, old_vec->array[i]);
+    }
+    for(int i = 0; i < start->stack_len; ++i)
+    {
+        CharPosition p = run->old_checkpoints->stacks.array[start->stack_start + i];
+        if(p.c == '<')
+        {
+            Push(open, vec->len);
+        }
+        else
+        {
+            open->len--;
+        }
+        Insert(vec, p);
+    }
+    *settled_len = start->result_len;
+}
+
+// NOTE checks if the change starts in [from, to)
+void MarkDirtyLine(IncrementalRun *run, size_t from, size_t to, CharPositionVector *vec, int settled_len)
+{
+    // NOTE the angle brackets that are not settled when reaching the change can end up
+    // different, so the bracket pass has to restart before them
+    if(run->edit && from <= run->edit->start && run->edit->start < to && settled_len < vec->len &&
+       vec->array[settled_len].pair.a < run->dirty_line)
+    {
+        run->dirty_line = vec->array[settled_len].pair.a;
+    }
+}
+
+// NOTE returns true when the state matches the previous run and the pass can stop
+bool CheckpointAngleBrackets(IncrementalRun *run, size_t offset, int line, CharPositionVector *vec, int settled_len)
+{
+    CharPosition *tail = vec->array + settled_len;
+    int tail_len = vec->len - settled_len;
+
+    Checkpoint *old = FindConvergence(run, offset, line);
+    if(old && IsSameStack(run, old, tail, tail_len))
+    {
+        Converge(run, old, offset);
+        return true;
+    }
+
+    if(ShouldSaveCheckpoint(run, line))
+    {
+        Checkpoint *checkpoint = SaveCheckpoint(run, offset, line);
+        checkpoint->result_len = settled_len;
+        checkpoint->stack_len = tail_len;
+        for(int i = 0; i < tail_len; ++i)
+        {
+            Insert(&run->checkpoints->stacks, tail[i]);
+        }
+    }
+
+    return false;
+}
+
+void FinishAngleBrackets(IncrementalRun *run, size_t offset, CharPositionVector *vec, int settled_len, CharPositionVector *old_vec)
+{
+    MarkDirtyLine(run, offset, offset + 1, vec, settled_len);
+
+    if(run->converged)
+    {
+        // NOTE from the settled ones on the previous result is still valid
+        vec->len = settled_len;
+        for(int i = run->converged->result_len; i < old_vec->len; ++i)
+        {
+            CharPosition p = old_vec->array[i];
+            MapPosition(run->edit, p.pair, &p.pair);
+            Insert(vec, p);
+        }
+        CopyConvergedCheckpoints(run, settled_len - run->converged->result_len);
+    }
+}
+
+// NOTE a '>' closes the last '<' that is still open, the ones still open when reaching a
+// terminator were comparisons and get dropped, the terminators are all that depends on the language
+#define C_TEMPLATE_TERMINATORS ";{.*"
+#define RUST_GENERIC_TERMINATORS "{|^!"
+
+CharPositionVector ParseAngleBrackets(char *buffer, size_t length, Arena *arena, const char *terminators,
+                                      IncrementalRun *run = NULL, CharPositionVector *old_brackets = NULL)
+{
+    IntPair cur_pos = { 1, 1 };
+
+    // NOTE the brackets before settled_len can't be deleted anymore
+    int settled_len = 0;
+
+    Scanner scanner;
+    int classes = SCAN_ANGLE | SCAN_NEWLINE | SCAN_EXTRA;
+    StartScanner(&scanner, buffer, length, classes, terminators);
+
+    CharPositionVector brackets;
+    if(run && run->edit)
+    {
+        brackets = MakeVector(arena, old_brackets->len + 64);
+    }
+    else
+    {
+        brackets = MakeVector(arena, ScanCount(&scanner, SCAN_ANGLE));
+    }
+
+    OpenAngleBrackets open = {};
+    open.arena = arena;
+
+    const char *c = buffer;
+
+    if(run && run->start)
+    {
+        ResumeAngleBrackets(run, &brackets, &settled_len, &open, old_brackets);
+        c = buffer + run->start->offset;
+        cur_pos.a = run->start->line;
+    }
+
+    for(; *c != '\0'; c++)
+    {
+        if(run)
+        {
+            MarkDirtyLine(run, c - buffer, c + 1 - buffer, &brackets, settled_len);
+        }
+        if(strchr(terminators, *c))
+        {
+            DropOpenAngleBrackets(&brackets, &open);
+            settled_len = brackets.len;
+        }
+        if(*c == '\n')
+        {
+            cur_pos.a++;
+            cur_pos.b = 1;
+
+            if(run && CheckpointAngleBrackets(run, c + 1 - buffer, cur_pos.a, &brackets, settled_len))
+            {
+                break;
+            }
+        }
+        else
+        {
+            CharPosition p = {};
+            p.c = *c;
+            p.pair = cur_pos;
+
+            if(*c == '<')
+            {
+                Push(&open, brackets.len);
+                Insert(&brackets, p);
+            }
+            else if(*c == '>')
+            {
+                // NOTE ignore arrow
+                if(open.len > 0 && *(c - 1) != '-')
+                {
+                    open.len--;
+                    Insert(&brackets, p);
+                }
+            }
+            cur_pos.b++;
+        }
+
+        // NOTE nothing happens on the other characters
+        const char *next = ScanNext(&scanner, c + 1, classes);
+        if(run)
+        {
+            MarkDirtyLine(run, c + 1 - buffer, next - buffer, &brackets, settled_len);
+        }
+        cur_pos.b += next - (c + 1);
+        c = next - 1;
+    }
+
+    if(run)
+    {
+        FinishAngleBrackets(run, c - buffer, &brackets, settled_len, old_brackets);
+    }
+
+    return brackets;
+}
+
+// NOTE: a large buffer is split at line starts into chunks that are parsed in parallel, every
+// chunk has its own arena so the threads never share one, the results are the same as the
+// ones of the sequential passes
+#ifndef PARALLEL_MIN_LENGTH
+#define PARALLEL_MIN_LENGTH (16 * 1024 * 1024)
+#endif
+#ifndef PARALLEL_CHUNK_LENGTH
+#define PARALLEL_CHUNK_LENGTH (1024 * 1024)
+#endif
+
+// NOTE the state a chunk of the bracket pass leaves for the merge, entries are pairs like the
+// result, (close, open), but the levels are relative to the chunk: the closing bracket has the
+// segment the opening one was pushed in and the opening one its depth in the chunk, a closing
+// bracket without an opening one in the chunk is an escape, the opening one of its entry has
+// c == 0 and the closing one has the index of the escape as its level
+struct BracketChunk
+{
+    CharPositionVector entries;
+    CharPositionVector stack;
+    CheckpointVector checkpoints;
+
+    // NOTE an escape is stored with its level set when the chunk had brackets open, then if it
+    // closes anything the chunk can't be merged and is parsed again knowing the stack
+    CharPositionVector escapes;
+    CharPosition *matches;
+    int num_segments;
+
+    // NOTE a segment starts after every escape that came with the chunk stack empty, the
+    // brackets opened in it are on top of the first bases[segment] brackets of entry_stack
+    int *bases;
+    CharPosition *entry_stack;
+
+    bool exact;
+    size_t result_start;
+    int num_pairs;
+};
+
+struct ParseChunk
+{
+    size_t begin;
+    size_t end;
+    int line;
+    bool has_null;
+
+    Arena arena;
+
+    // NOTE the mask pass
+    CheckpointVector checkpoints;
+    Checkpoint exit;
+    PoundIfParsing exit_pound_ifs;
+
+    BracketChunk brackets;
+};
+
+struct ParseChunks
+{
+    ParseChunk *array;
+    int count;
+    int num_threads;
+    int num_lines;
+};
+
+struct ParallelTasks
+{
+    void (*task)(void *data, int index);
+    void *data;
+    int count;
+    int next;
+};
+
+void *RunParallelTasks(void *data)
+{
+    ParallelTasks *tasks = (ParallelTasks *)data;
+    for(;;)
+    {
+        int index = __atomic_fetch_add(&tasks->next, 1, __ATOMIC_RELAXED);
+        if(index >= tasks->count)
+        {
+            return NULL;
+        }
+        tasks->task(tasks->data, index);
+    }
+}
+
+// NOTE runs the task for every index in [0, count) on num_threads threads, the calling one
+// included, and returns when they are all done
+void RunParallel(int num_threads, int count, void (*task)(void *data, int index), void *data)
+{
+    ParallelTasks tasks = {};
+    tasks.task = task;
+    tasks.data = data;
+    tasks.count = count;
+
+    if(num_threads > count)
+    {
+        num_threads = count;
+    }
+
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * (num_threads > 0 ? num_threads : 1));
+    int num_started = 0;
+    for(int i = 1; i < num_threads; ++i)
+    {
+        if(pthread_create(&threads[num_started], NULL, RunParallelTasks, &tasks) == 0)
+        {
+            num_started++;
+        }
+    }
+
+    RunParallelTasks(&tasks);
+
+    for(int i = 0; i < num_started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+void CountChunkLines(void *data, int index)
+{
+    ParseChunks *chunks = (ParseChunks *)((void **)data)[0];
+    const char *buffer = (const char *)((void **)data)[1];
+    ParseChunk *chunk = &chunks->array[index];
+
+    const char *end = buffer + chunk->end;
+    int lines = 0;
+    for(const char *c = buffer + chunk->begin; (c = (const char *)memchr(c, '\n', end - c)); ++c)
+    {
+        lines++;
+    }
+    chunk->line = lines;
+    chunk->has_null = (memchr(buffer + chunk->begin, '\0', chunk->end - chunk->begin) != NULL);
+}
+
+// NOTE only worth it for a full parse of a large buffer, a buffer with a '\0' in it is left to
+// the sequential passes as they stop there
+bool SplitIntoChunks(String *string, int num_threads, ParseChunks *chunks)
+{
+    *chunks = {};
+    if(num_threads < 2 || string->length < PARALLEL_MIN_LENGTH)
+    {
+        return false;
+    }
+
+    size_t chunk_length = string->length / ((size_t)num_threads * 4);
+    if(chunk_length < PARALLEL_CHUNK_LENGTH)
+    {
+        chunk_length = PARALLEL_CHUNK_LENGTH;
+    }
+
+    int max_chunks = (int)(string->length / chunk_length) + 1;
+    chunks->array = (ParseChunk *)calloc(max_chunks, sizeof(ParseChunk));
+    chunks->num_threads = num_threads;
+
+    size_t begin = 0;
+    while(begin < string->length)
+    {
+        size_t end = begin + chunk_length;
+        if(end >= string->length)
+        {
+            end = string->length;
+        }
+        else
+        {
+            const char *newline = (const char *)memchr(string->data + end - 1, '\n', string->length - end + 1);
+            end = newline ? newline + 1 - string->data : string->length;
+        }
+
+        ParseChunk *chunk = &chunks->array[chunks->count++];
+        chunk->begin = begin;
+        chunk->end = end;
+        begin = end;
+    }
+
+    void *data[2] = {chunks, string->data};
+    RunParallel(num_threads, chunks->count, CountChunkLines, data);
+
+    int line = 1;
+    bool has_null = false;
+    for(int i = 0; i < chunks->count; ++i)
+    {
+        int lines = chunks->array[i].line;
+        chunks->array[i].line = line;
+        line += lines;
+        has_null = has_null || chunks->array[i].has_null;
+    }
+
+    if(has_null || chunks->count < 2)
+    {
+        free(chunks->array);
+        *chunks = {};
+        return false;
+    }
+    chunks->num_lines = line;
+
+    return true;
+}
+
+void Free(ParseChunks *chunks)
+{
+    for(int i = 0; i < chunks->count; ++i)
+    {
+        Free(&chunks->array[i].arena);
+    }
+    free(chunks->array);
+    *chunks = {};
+}
+
+// NOTE the C and rust mask passes have the same shape, mask runs one of them
+struct MaskPass
+{
+    String *string;
+    char *buffer;
+    bool check_pound_ifs;
+    PoundIfDefines *defines;
+    ParseChunks *chunks;
+
+    void (*mask)(MaskPass *pass, IncrementalRun *run, const char *old_buffer);
+    struct Language *language;
+};
+
+// NOTE every chunk but the first one is lexed as if it started in code, outside of the #ifs
+// it is in, that is what it starts in most of the time
+void MaskChunk(void *data, int index)
+{
+    MaskPass *pass = (MaskPass *)data;
+    ParseChunk *chunk = &pass->chunks->array[index];
+
+    chunk->checkpoints = MakeCheckpointVector(&chunk->arena);
+    chunk->exit.pound_ifs = &chunk->exit_pound_ifs;
+
+    PoundIfParsing pound_ifs;
+    StartBasePoundIfs(&pound_ifs);
+
+    Checkpoint start = {};
+    start.offset = chunk->begin;
+    start.line = chunk->line;
+    start.pound_ifs = pass->check_pound_ifs ? &pound_ifs : NULL;
+
+    IncrementalRun run = {};
+    run.checkpoints = &chunk->checkpoints;
+    run.last_line = chunk->line;
+    run.start = (index > 0) ? &start : NULL;
+    run.end_offset = chunk->end;
+    run.exit = &chunk->exit;
+
+    pass->mask(pass, &run, NULL);
+}
+
+bool IsCodeStart(Checkpoint *checkpoint)
+{
+    return (checkpoint->info.current_string == '\0' && checkpoint->info.current_string_count == 0 &&
+            checkpoint->comment_depth == 0 && checkpoint->lexer_state == 0);
+}
+
+// NOTE once the state a chunk starts in is known its guess is either right, once the #ifs are
+// put back under it, or it's lexed again from the right state up to the first checkpoint where
+// it is the same as the guess, usually the end of the comment or string it started in
+void MaskParallel(MaskPass *pass, CheckpointVector *checkpoints)
+{
+    ParseChunks *chunks = pass->chunks;
+    RunParallel(chunks->num_threads, chunks->count, MaskChunk, pass);
+
+    ParseChunk *first = &chunks->array[0];
+    for(int i = 0; i < first->checkpoints.len; ++i)
+    {
+        CopyCheckpoint(checkpoints, &first->checkpoints, &first->checkpoints.array[i], NULL);
+    }
+
+    Checkpoint entry = first->exit;
+    PoundIfParsing entry_pound_ifs = first->exit_pound_ifs;
+
+    for(int k = 1; k < chunks->count; ++k)
+    {
+        ParseChunk *chunk = &chunks->array[k];
+
+        bool composed = true;
+        PoundIfParsing exit_pound_ifs = {};
+        if(pass->check_pound_ifs)
+        {
+            composed = ComposePoundIfs(&entry_pound_ifs, &chunk->exit_pound_ifs, &exit_pound_ifs);
+            for(int i = 0; i < chunk->checkpoints.len && composed; ++i)
+            {
+                PoundIfParsing *pound_ifs = chunk->checkpoints.array[i].pound_ifs;
+                ComposePoundIfs(&entry_pound_ifs, pound_ifs, pound_ifs);
+            }
+        }
+
+        CheckpointVector *chunk_checkpoints = &chunk->checkpoints;
+        CheckpointVector relexed = {};
+        Checkpoint exit = chunk->exit;
+        if(!composed || !IsCodeStart(&entry))
+        {
+            relexed = MakeCheckpointVector(&chunk->arena);
+            ParseEdit same = {};
+
+            Checkpoint start = entry;
+            start.offset = chunk->begin;
+            start.line = chunk->line;
+            start.pound_ifs = &entry_pound_ifs;
+
+            Checkpoint relexed_exit = {};
+            PoundIfParsing relexed_pound_ifs = {};
+            relexed_exit.pound_ifs = &relexed_pound_ifs;
+
+            IncrementalRun run = {};
+            run.checkpoints = &relexed;
+            run.last_line = chunk->line;
+            run.start = &start;
+            run.end_offset = chunk->end;
+            run.exit = &relexed_exit;
+            if(composed)
+            {
+                run.old_checkpoints = &chunk->checkpoints;
+                run.edit = &same;
+                run.converge_after = chunk->begin + 1;
+            }
+
+            pass->mask(pass, &run, pass->buffer);
+
+            chunk_checkpoints = &relexed;
+            if(!run.converged)
+            {
+                exit = relexed_exit;
+                exit_pound_ifs = relexed_pound_ifs;
+            }
+        }
+
+        for(int i = 0; i < chunk_checkpoints->len; ++i)
+        {
+            CopyCheckpoint(checkpoints, chunk_checkpoints, &chunk_checkpoints->array[i], NULL);
+        }
+
+        entry = exit;
+        entry_pound_ifs = exit_pound_ifs;
+    }
+}
+
+// NOTE the same as the loop of ParseGenericFile on [begin, end), with an empty stack the
+// brackets closing the ones opened before the chunk are left for the merge, with the stack
+// the chunk really starts with (exact) it gives the final pairs
+void ParseBracketChunk(ParseChunk *chunk, const char *buffer, CharPositionVector generics, CharPair generic_pair,
+                       CharPosition *stack, int stack_len, bool exact, uint32_t *line_starts)
+{
+    BracketChunk *brackets = &chunk->brackets;
+    Arena *arena = &chunk->arena;
+
+    Scanner scanner;
+    int classes = SCAN_BRACKET | SCAN_NEWLINE | (generics.len > 0 ? SCAN_ANGLE : 0);
+    StartScanner(&scanner, buffer + chunk->begin, chunk->end - chunk->begin, classes);
+
+    brackets->entries = MakeVector(arena, ScanCount(&scanner, classes & ~SCAN_NEWLINE));
+    brackets->stack = MakeVector(arena, stack_len + 64);
+    brackets->checkpoints = MakeCheckpointVector(arena);
+    brackets->escapes = MakeVector(arena, 0);
+    brackets->exact = exact;
+
+    CharPositionVector *entries = &brackets->entries;
+    CharPositionVector *s = &brackets->stack;
+    for(int i = 0; i < stack_len; ++i)
+    {
+        PushCharPosition(s, stack[i]);
+    }
+
+    IntPair cur_pos = { chunk->line, 1 };
+    int last_line = chunk->line;
+    int segment = 0;
+
+    // NOTE the generics are sorted by position
+    int generic_i = 0;
+    int high = generics.len;
+    while(generic_i < high)
+    {
+        int middle = generic_i + (high - generic_i) / 2;
+        if(generics.array[middle].pair.a < chunk->line)
+        {
+            generic_i = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    const char *end = buffer + chunk->end;
+    for(const char *c = buffer + chunk->begin; c < end; c++)
+    {
+        IntPair current_generic = {};
+        if(generic_i < generics.len)
+        {
+            current_generic = generics.array[generic_i].pair;
+        }
+        if(*c == '\n')
+        {
+            cur_pos.a++;
+            cur_pos.b = 1;
+            line_starts[cur_pos.a - 1] = (uint32_t)(c + 1 - buffer);
+
+            // NOTE the level of the checkpoint is the segment until the merge
+            if(cur_pos.a - last_line >= CHECKPOINT_INTERVAL && c + 1 < end)
+            {
+                Checkpoint checkpoint = {};
+                checkpoint.offset = c + 1 - buffer;
+                checkpoint.line = cur_pos.a;
+                checkpoint.level = segment;
+                checkpoint.generic_index = generic_i;
+                checkpoint.result_len = entries->len;
+                checkpoint.stack_start = brackets->checkpoints.stacks.len;
+                checkpoint.stack_len = s->len;
+                for(int i = 0; i < s->len; ++i)
+                {
+                    Insert(&brackets->checkpoints.stacks, s->array[i]);
+                }
+                Insert(&brackets->checkpoints, checkpoint);
+                last_line = cur_pos.a;
+            }
+        }
+        else
+        {
+            CharPosition p = {};
+            p.c = *c;
+            p.pair = cur_pos;
+            p.offset = (uint32_t)(c - buffer);
+            bool is_generic = (current_generic.a == cur_pos.a && current_generic.b == cur_pos.b);
+            if(*c == '(' || *c == '[' || *c == '{' || (is_generic && *c == generic_pair.a))
+            {
+                p.level = s->len;
+                PushCharPosition(s, p);
+                if(is_generic)
+                {
+                    generic_i++;
+                }
+            }
+            else if(*c == ')' || *c == ']' || *c == '}' || (is_generic && *c == generic_pair.b))
+            {
+                char opening_bracket = GetMatchingPair(*c);
+                int i = s->len - 1;
+                while(i >= 0 && s->array[i].c != opening_bracket)
+                {
+                    i--;
+                }
+
+                if(i >= 0)
+                {
+                    p.level = segment;
+                    Insert(entries, p);
+                    Insert(entries, s->array[i]);
+                    s->len = i;
+                }
+                else if(!exact)
+                {
+                    CharPosition escape = p;
+                    escape.level = (s->len > 0);
+                    p.level = brackets->escapes.len;
+                    Insert(&brackets->escapes, escape);
+                    Insert(entries, p);
+                    Insert(entries, CharPosition{});
+                    if(s->len == 0)
+                    {
+                        segment++;
+                    }
+                }
+
+                if(is_generic)
+                {
+                    generic_i++;
+                }
+            }
+            cur_pos.b++;
+        }
+
+        const char *next = ScanNext(&scanner, c + 1, classes);
+        cur_pos.b += next - (c + 1);
+        c = next - 1;
+    }
+
+    brackets->num_segments = segment;
+}
+
+struct BracketPass
+{
+    const char *buffer;
+    CharPositionVector generics;
+    CharPair generic_pair;
+    ParseChunks *chunks;
+    PairVector result;
+    uint32_t *line_starts;
+};
+
+void ParseBracketChunkTask(void *data, int index)
+{
+    BracketPass *pass = (BracketPass *)data;
+    ParseBracketChunk(&pass->chunks->array[index], pass->buffer, pass->generics, pass->generic_pair,
+                      NULL, 0, false, pass->line_starts);
+}
+
+// NOTE the chunk entries get their real levels and the escapes the bracket they close, the
+// checkpoints get the index in the result they correspond to
+void WriteBracketChunk(void *data, int index)
+{
+    BracketPass *pass = (BracketPass *)data;
+    BracketChunk *brackets = &pass->chunks->array[index].brackets;
+
+    PairVector *out = &pass->result;
+    int checkpoint_i = 0;
+    int written = 0;
+    for(int k = 0; k + 1 < brackets->entries.len; k += 2)
+    {
+        while(checkpoint_i < brackets->checkpoints.len && brackets->checkpoints.array[checkpoint_i].result_len == k)
+        {
+            brackets->checkpoints.array[checkpoint_i++].result_len = (int)brackets->result_start + written;
+        }
+
+        CharPosition p = brackets->entries.array[k];
+        CharPosition p2 = brackets->entries.array[k + 1];
+        if(p2.c)
+        {
+            p2.level += brackets->bases[p.level];
+        }
+        else
+        {
+            p2 = brackets->matches[p.level];
+            if(!p2.c)
+            {
+                continue;
+            }
+        }
+        size_t i = brackets->result_start + written++;
+        out->open[i] = p2.offset;
+        out->close[i] = p.offset;
+        out->level[i] = (uint16_t)p2.level;
+    }
+    for(; checkpoint_i < brackets->checkpoints.len; ++checkpoint_i)
+    {
+        brackets->checkpoints.array[checkpoint_i].result_len = (int)brackets->result_start + written;
+    }
+}
+
+// NOTE the chunks are merged in order keeping the stack of the brackets still open, every
+// escape closes the matching one in it like InsertPair would, then the brackets the chunk
+// leaves open go on top, only the escapes and those brackets are looked at here
+// NOTE every chunk knows the line it starts at, so it writes the starts of its lines in place
+PairVector ParseGenericFileParallel(const char *buffer, size_t length, Arena *arena, OffsetVector *line_starts,
+                                    CharPositionVector generics, CharPair generic_pair,
+                                    ParseChunks *chunks, CheckpointVector *checkpoints)
+{
+    *line_starts = MakeOffsetVector(arena, chunks->num_lines + 1);
+    line_starts->len = chunks->num_lines + 1;
+    line_starts->array[0] = 0;
+    line_starts->array[chunks->num_lines] = (uint32_t)length;
+
+    BracketPass pass = {};
+    pass.buffer = buffer;
+    pass.generics = generics;
+    pass.generic_pair = generic_pair;
+    pass.chunks = chunks;
+    pass.line_starts = line_starts->array;
+    RunParallel(chunks->num_threads, chunks->count, ParseBracketChunkTask, &pass);
+
+    Arena merge_arena = {};
+    CharPositionVector stack = MakeVector(&merge_arena, 64);
+    size_t result_len = 0;
+
+    for(int k = 0; k < chunks->count; ++k)
+    {
+        ParseChunk *chunk = &chunks->array[k];
+        BracketChunk *brackets = &chunk->brackets;
+
+        brackets->entry_stack = PushArray(&chunk->arena, CharPosition, stack.len);
+        memcpy(brackets->entry_stack, stack.array, sizeof(CharPosition) * stack.len);
+        brackets->bases = PushArray(&chunk->arena, int, brackets->num_segments + 1);
+        brackets->matches = PushArray(&chunk->arena, CharPosition, brackets->escapes.len);
+
+        int segment = 0;
+        int unmatched = 0;
+        bool exact = false;
+        brackets->bases[0] = stack.len;
+        for(int e = 0; e < brackets->escapes.len && !exact; ++e)
+        {
+            CharPosition escape = brackets->escapes.array[e];
+            char opening_bracket = GetMatchingPair(escape.c);
+            int i = stack.len - 1;
+            while(i >= 0 && stack.array[i].c != opening_bracket)
+            {
+                i--;
+            }
+
+            brackets->matches[e] = {};
+            if(escape.level)
+            {
+                // NOTE it would have dropped the brackets the chunk had open
+                exact = (i >= 0);
+                unmatched++;
+                continue;
+            }
+
+            if(i >= 0)
+            {
+                brackets->matches[e] = stack.array[i];
+                stack.len = i;
+            }
+            else
+            {
+                unmatched++;
+            }
+            segment++;
+            brackets->bases[segment] = stack.len;
+        }
+
+        if(exact)
+        {
+            stack.len = brackets->bases[0];
+            ParseBracketChunk(chunk, buffer, generics, generic_pair, stack.array, stack.len, true,
+                              line_starts->array);
+            brackets->bases[0] = 0;
+            brackets->num_segments = 0;
+            unmatched = 0;
+
+            stack.len = 0;
+            for(int i = 0; i < brackets->stack.len; ++i)
+            {
+                PushCharPosition(&stack, brackets->stack.array[i]);
+            }
+        }
+        else
+        {
+            int base = brackets->bases[brackets->num_segments];
+            for(int i = 0; i < brackets->stack.len; ++i)
+            {
+                CharPosition p = brackets->stack.array[i];
+                p.level += base;
+                PushCharPosition(&stack, p);
+            }
+        }
+
+        brackets->result_start = result_len;
+        brackets->num_pairs = brackets->entries.len / 2 - unmatched;
+        result_len += brackets->num_pairs;
+    }
+
+    PairVector result = MakePairVector(arena, (int)result_len);
+    result.len = (int)result_len;
+    pass.result = result;
+    RunParallel(chunks->num_threads, chunks->count, WriteBracketChunk, &pass);
+
+    // NOTE the stacks of the checkpoints are the part of the entry stack under their segment
+    // and the brackets open in the chunk
+    for(int k = 0; k < chunks->count; ++k)
+    {
+        BracketChunk *brackets = &chunks->array[k].brackets;
+        for(int i = 0; i < brackets->checkpoints.len; ++i)
+        {
+            Checkpoint checkpoint = brackets->checkpoints.array[i];
+            int base = brackets->bases[checkpoint.level];
+
+            Checkpoint copy = checkpoint;
+            copy.stack_start = checkpoints->stacks.len;
+            copy.stack_len = base + checkpoint.stack_len;
+            copy.level = copy.stack_len;
+            for(int j = 0; j < base; ++j)
+            {
+                Insert(&checkpoints->stacks, brackets->entry_stack[j]);
+            }
+            for(int j = 0; j < checkpoint.stack_len; ++j)
+            {
+                CharPosition p = brackets->checkpoints.stacks.array[checkpoint.stack_start + j];
+                p.level += base;
+                Insert(&checkpoints->stacks, p);
+            }
+            Insert(checkpoints, copy);
+        }
+    }
+
+    Free(&merge_arena);
+
+    return result;
+}
+
+// NOTE: a full parse whose state is not kept for a next run doesn't need the masked buffer, the
+// source is masked a window at a time into a small buffer and the <> and bracket passes go over
+// every window right after it, only their stacks carry over to the next one. A '<' is settled by
+// a terminator or by its '>', so the bracket pass stops before the first one still open and
+// that part of the window is kept for the next one, a '<' still open FUSED_LOOKAHEAD bytes later
+// is dropped as a comparison, that is the only way the pairs can differ from the other passes
+#define FUSED_WINDOW_LENGTH (256 * 1024)
+#define FUSED_LOOKAHEAD (256 * 1024)
+// NOTE the lexers of the languages file write again up to LEXER_MAX_DELIMITER characters
+// before the current one, so the last ones of a window are only passed on with the next one
+#define FUSED_HOLD_BACK 8
+
+struct FusedPass
+{
+    // NOTE the window holds the masked source from window_offset to masked_end, window[-1] is
+    // the character before it so the arrows can be told apart at its start
+    char *allocation;
+    char *window;
+    size_t window_size;
+    size_t window_offset;
+    size_t masked_end;
+    size_t angle_offset;
+    size_t bracket_offset;
+
+    // NOTE the angle brackets from the first one the bracket pass has not reached on
+    const char *terminators;
+    CharPositionVector generics;
+    OpenAngleBrackets open;
+    int num_candidates;
+    int num_generics;
+
+    CharPositionVector stack;
+    int level;
+    int generic_i;
+};
+
+bool ReserveWindow(FusedPass *pass, size_t size)
+{
+    if(size <= pass->window_size)
+    {
+        return true;
+    }
+
+    size_t window_size = pass->window_size ? pass->window_size : 2 * FUSED_WINDOW_LENGTH;
+    while(window_size < size)
+    {
+        window_size *= 2;
+    }
+
+    char *allocation = (char *)realloc(pass->allocation, FUSED_HOLD_BACK + window_size);
+    if(!allocation)
+    {
+        return false;
+    }
+    if(!pass->allocation)
+    {
+        allocation[FUSED_HOLD_BACK - 1] = ' ';
+    }
+
+    pass->allocation = allocation;
+    pass->window = allocation + FUSED_HOLD_BACK;
+    pass->window_size = window_size;
+
+    return true;
+}
+
+// NOTE the same as the loop of ParseAngleBrackets from angle_offset to to
+void FusedAngleBrackets(FusedPass *pass, size_t to)
+{
+    const char *from = pass->window + (pass->angle_offset - pass->window_offset);
+    const char *end = pass->window + (to - pass->window_offset);
+
+    Scanner scanner;
+    int classes = SCAN_ANGLE | SCAN_EXTRA;
+    StartScanner(&scanner, from, end - from, classes, pass->terminators);
+
+    for(const char *c = ScanNext(&scanner, from, classes); c < end; c = ScanNext(&scanner, c + 1, classes))
+    {
+        if(strchr(pass->terminators, *c))
+        {
+            DropOpenAngleBrackets(&pass->generics, &pass->open);
+            continue;
+        }
+
+        CharPosition p = {};
+        p.c = *c;
+        p.offset = (uint32_t)(pass->window_offset + (c - pass->window));
+        if(*c == '<')
+        {
+            pass->num_candidates++;
+            Push(&pass->open, pass->generics.len);
+            Insert(&pass->generics, p);
+        }
+        else if(pass->open.len > 0 && *(c - 1) != '-')
+        {
+            pass->open.len--;
+            pass->num_generics++;
+            Insert(&pass->generics, p);
+        }
+    }
+
+    pass->angle_offset = to;
+}
+
+// NOTE the same as the loop of ParseGenericFile from bracket_offset to to, the generics are
+// matched by their offsets, then the ones it went past are dropped
+void FusedBrackets(FusedPass *pass, size_t to, ParseState *state)
+{
+    const char *from = pass->window + (pass->bracket_offset - pass->window_offset);
+    const char *end = pass->window + (to - pass->window_offset);
+
+    Scanner scanner;
+    int classes = SCAN_BRACKET | SCAN_NEWLINE | (pass->generics.len > 0 ? SCAN_ANGLE : 0);
+    StartScanner(&scanner, from, end - from, classes);
+
+    CharPositionVector *generics = &pass->generics;
+    for(const char *c = ScanNext(&scanner, from, classes); c < end; c = ScanNext(&scanner, c + 1, classes))
+    {
+        uint32_t offset = (uint32_t)(pass->window_offset + (c - pass->window));
+        if(*c == '\n')
+        {
+            Insert(&state->line_starts, offset + 1);
+            continue;
+        }
+
+        CharPosition p = {};
+        p.c = *c;
+        p.offset = offset;
+        bool is_generic = (pass->generic_i < generics->len && generics->array[pass->generic_i].offset == offset);
+        if(*c == '(' || *c == '[' || *c == '{' || (is_generic && *c == '<'))
+        {
+            p.level = pass->level;
+            PushCharPosition(&pass->stack, p);
+            pass->level++;
+        }
+        else if(*c == ')' || *c == ']' || *c == '}' || (is_generic && *c == '>'))
+        {
+            pass->level = InsertPair(&state->result, &pass->stack, pass->level, GetMatchingPair(*c), p);
+        }
+        if(is_generic)
+        {
+            pass->generic_i++;
+        }
+    }
+
+    // NOTE the '<' still open are all after to
+    if(pass->generic_i > 0)
+    {
+        memmove(generics->array, generics->array + pass->generic_i,
+                sizeof(CharPosition) * (generics->len - pass->generic_i));
+        generics->len -= pass->generic_i;
+        for(int i = 0; i < pass->open.len; ++i)
+        {
+            pass->open.array[i] -= pass->generic_i;
+        }
+        pass->generic_i = 0;
+    }
+
+    pass->bracket_offset = to;
+}
+
+// NOTE the fused pass takes the source a window at a time, the window from begin on ends at the
+// first line start at least FUSED_WINDOW_LENGTH bytes later, or at the end and then at_end is
+// set, its data can be read up to FUSED_HOLD_BACK bytes before it and up to a '\0' after it
+bool GetStringWindow(void *source, size_t begin, String *window, bool *at_end)
+{
+    String *string = (String *)source;
+
+    size_t end = begin + FUSED_WINDOW_LENGTH;
+    if(end >= string->length)
+    {
+        end = string->length;
+    }
+    else
+    {
+        const char *newline = (const char *)memchr(string->data + end - 1, '\n', string->length - end + 1);
+        end = newline ? newline + 1 - string->data : string->length;
+    }
+
+    *window = {};
+    window->data = string->data + begin;
+    window->length = end - begin;
+    *at_end = (end == string->length);
+
+    return true;
+}
+
+// NOTE terminators is NULL when the <> are not checked, the windows end at line starts like the
+// chunks so the mask pass starts every one from the state it left the previous one in
+// NOTE total is the length of the source for the latency budget, 0 when it's streamed
+void ParseFused(MaskPass *mask, const char *terminators, ParseState *state,
+                bool (*next_window)(void *source, size_t begin, String *window, bool *at_end), void *source,
+                size_t total)
+{
+    RunStats *stats = state->stats;
+    Arena *arena = &state->arena;
+
+    state->result = MakePairVector(arena, 1024);
+    state->line_starts = MakeOffsetVector(arena, 1024);
+    Insert(&state->line_starts, 0);
+
+    FusedPass pass = {};
+    pass.terminators = terminators;
+    pass.generics = MakeVector(arena, 64);
+    pass.open.arena = arena;
+    pass.stack = MakeVector(arena, 64);
+
+    PoundIfParsing pound_ifs = {};
+    Checkpoint start = {};
+    Checkpoint exit = {};
+    exit.pound_ifs = &pound_ifs;
+
+    size_t length = 0;
+    bool last = false;
+    while(!last && !IsSuperseded(state->job))
+    {
+        String window;
+        bool at_end = false;
+        size_t begin = pass.masked_end;
+
+        // NOTE over the budget the '<' still open are dropped and the rest of the <> are not
+        // checked, at the viewport level the parse stops and ParseSource starts over
+        if(begin > 0 && CheckBudget(state->budget, begin, total) >= BUDGET_NO_TEMPLATES)
+        {
+            if(state->budget->level >= BUDGET_VIEWPORT)
+            {
+                break;
+            }
+            if(pass.terminators)
+            {
+                DropOpenAngleBrackets(&pass.generics, &pass.open);
+                pass.terminators = NULL;
+                state->budget->parse_start = GetNanoseconds();
+                state->budget->start_done = begin;
+            }
+        }
+
+        if(!next_window(source, begin, &window, &at_end) || begin + window.length > UINT32_MAX ||
+           !ReserveWindow(&pass, begin + window.length - pass.window_offset + 1))
+        {
+            break;
+        }
+
+        uint64_t phase_start = StartPhase(stats);
+        IncrementalRun run = {};
+        run.start = (begin > 0) ? &start : NULL;
+        run.end_offset = window.length;
+        run.exit = &exit;
+        mask->string = &window;
+        mask->buffer = pass.window + (begin - pass.window_offset);
+        mask->mask(mask, &run, NULL);
+        FinishPhase(stats, PHASE_MASK, phase_start, exit.offset);
+        if(stats)
+        {
+            stats->hidden_blocks += run.num_hidden_blocks;
+        }
+
+        // NOTE the mask pass stops early at a '\0' like the other passes
+        start = exit;
+        start.offset = 0;
+        pass.masked_end = begin + exit.offset;
+        last = (exit.offset < window.length || at_end);
+        length = begin + window.length;
+
+        size_t ready = pass.masked_end;
+        if(!last)
+        {
+            ready = (ready > pass.angle_offset + FUSED_HOLD_BACK) ? ready - FUSED_HOLD_BACK : pass.angle_offset;
+        }
+
+        size_t settled = ready;
+        if(pass.terminators)
+        {
+            phase_start = StartPhase(stats);
+            size_t angle_bytes = ready - pass.angle_offset;
+            FusedAngleBrackets(&pass, ready);
+            FinishPhase(stats, PHASE_ANGLE, phase_start, angle_bytes);
+
+            // NOTE at the end the '<' still open are left in like ParseAngleBrackets does
+            if(pass.open.len > 0 && !last)
+            {
+                uint32_t first_open = pass.generics.array[pass.open.array[0]].offset;
+                if(ready - first_open > FUSED_LOOKAHEAD)
+                {
+                    DropOpenAngleBrackets(&pass.generics, &pass.open);
+                }
+                else
+                {
+                    settled = first_open;
+                }
+            }
+        }
+
+        phase_start = StartPhase(stats);
+        size_t bracket_bytes = settled - pass.bracket_offset;
+        FusedBrackets(&pass, settled, state);
+        FinishPhase(stats, PHASE_BRACKETS, phase_start, bracket_bytes);
+
+        // NOTE what the bracket pass has not reached yet moves to the start of the window
+        if(pass.bracket_offset > pass.window_offset)
+        {
+            size_t consumed = pass.bracket_offset - pass.window_offset;
+            pass.window[-1] = pass.window[consumed - 1];
+            memmove(pass.window, pass.window + consumed, pass.masked_end - pass.bracket_offset);
+            pass.window_offset = pass.bracket_offset;
+        }
+    }
+
+    if(!last)
+    {
+        // NOTE like a buffer too large for the 32 bit offsets, nothing is highlighted
+        state->result.len = 0;
+        state->line_starts.len = 0;
+    }
+    else
+    {
+        Insert(&state->line_starts, (uint32_t)length);
+    }
+
+    if(stats && terminators)
+    {
+        stats->template_candidates = pass.num_candidates;
+        stats->templates_rejected = pass.num_candidates - pass.num_generics;
+    }
+
+    free(pass.allocation);
+}
+
+void MaskCFile(String *string, char *buffer, bool check_pound_ifs, PoundIfDefines *defines,
+               IncrementalRun *run, const char *old_buffer)
+{
+    IntPair cur_pos = { 1, 1 };
+
+    StringParsingInfo info;
+
+    info.current_string = '\0';
+    info.current_string_count = 0;
+
+    const char *multiline_comment = NULL;
+
+    bool line_comment = false;
+    const char *last_closed_comment = 0;
+
+    PoundIfParsing parser = {};
+
+    size_t start_offset = 0;
+
+    if(run && run->start)
+    {
+        Checkpoint *start = run->start;
+        start_offset = start->offset;
+        if(old_buffer && old_buffer != buffer)
+        {
+            memcpy(buffer, old_buffer, start_offset);
+        }
+
+        cur_pos.a = start->line;
+        info = start->info;
+        if(start->comment_depth)
+        {
+            // NOTE only used to not close the comment on "/*/"
+            multiline_comment = string->data + start_offset - 2;
+        }
+        if(start->pound_ifs)
+        {
+            parser = *start->pound_ifs;
+        }
+    }
+
+    char *dc = buffer + start_offset - (run ? run->window_offset : 0);
+    size_t end_offset = (run && run->end_offset) ? run->end_offset : string->length;
+    const char *end = string->data + end_offset;
+
+    Scanner scanner;
+    StartScanner(&scanner, string->data + start_offset, end_offset - start_offset,
+                 SCAN_QUOTE | SCAN_SLASH | SCAN_STAR | SCAN_POUND | SCAN_NEWLINE);
+
+    int i = 0;
+    const char *c = string->data + start_offset;
+    for(; c < end && *c != '\0'; c++, dc++, i++)
+    {
+        bool should_check_char = false;
+
+        if(*c == '\n')
+        {
+            cur_pos.a++;
+            cur_pos.b = 1;
+            line_comment = false;
+
+            should_check_char = true;
+
+            if(check_pound_ifs)
+            {
+                FinishPoundIfLine(&parser);
+            }
+
+            if(run)
+            {
+                size_t offset = c + 1 - string->data;
+                Checkpoint *old = FindConvergence(run, offset, cur_pos.a);
+                if(old && old->info.current_string == info.current_string &&
+                   old->comment_depth == (multiline_comment != NULL) &&
+                   (!check_pound_ifs || IsSamePoundIfs(old->pound_ifs, &parser)))
+                {
+                    // NOTE a chunk converges with the buffer it is lexed into
+                    *dc = *c;
+                    if(old_buffer != buffer)
+                    {
+                        memcpy(dc + 1, old_buffer + old->offset, string->length - offset);
+                    }
+                    Converge(run, old, offset);
+                    break;
+                }
+                if(ShouldSaveCheckpoint(run, cur_pos.a))
+                {
+                    Checkpoint *checkpoint = SaveCheckpoint(run, offset, cur_pos.a);
+                    checkpoint->info = info;
+                    checkpoint->comment_depth = (multiline_comment != NULL);
+                    if(check_pound_ifs)
+                    {
+                        checkpoint->pound_ifs = PushArray(run->checkpoints->arena, PoundIfParsing, 1);
+                        *checkpoint->pound_ifs = parser;
+                    }
+                }
+            }
+        }
+        else
+        {
+            CharPosition p = {};
+            p.c = *c;
+            p.pair = cur_pos;
+            if(check_pound_ifs && IsPoundIfHidden(&parser))
+            {
+                if(*c == '#' && IsLineStart(c, string->data))
+                {
+                    StartPoundIfDirective(&parser, ParsePoundIfDirective(c, defines));
+                }
+            }
+            else if(line_comment)
+            {
+            }
+            else if(multiline_comment)
+            {
+                if(CCheckCloseMultilineComment(c, multiline_comment))
+                {
+                    multiline_comment = NULL;
+                    last_closed_comment = c;
+                }
+            }
+            else if(info.current_string == '\0' && CCheckStartMultilineComment(c, string->data, last_closed_comment))
+            {
+                multiline_comment = c;
+            }
+            else if(info.current_string == '\0' && CCheckStartLineComment(c, string->data, last_closed_comment))
+            {
+                line_comment = true;
+            }
+            else if(info.current_string == '\0')
+            {
+                if(check_pound_ifs && *c == '#' && IsLineStart(c, string->data))
+                {
+                    StartPoundIfDirective(&parser, ParsePoundIfDirective(c, defines));
+                }
+
+                should_check_char = true;
+
+                if(p.c == '\'' || p.c == '\"')
+                {
+                    info.current_string = *c;
+                }
+            }
+            else if(info.current_string)
+            {
+                CContinueString(&info, c);
+            }
+            cur_pos.b++;
+        }
+
+        if(!should_check_char)
+        {
+            *dc = ' ';
+        }
+        else
+        {
+            *dc = *c;
+        }
+
+        // NOTE a hidden block is skipped up to the next directive that can end it, only its
+        // lines are kept so the positions stay the same
+        if(check_pound_ifs && IsPoundIfHidden(&parser) && !parser.pending)
+        {
+            int lines = 0;
+            const char *next = SkipHiddenCode(&scanner, c + 1, string->data, defines, dc + 1, &lines);
+            size_t skipped = next - (c + 1);
+            run->num_hidden_blocks++;
+
+            if(lines > 0)
+            {
+                const char *line_start = next;
+                while(*(line_start - 1) != '\n')
+                {
+                    line_start--;
+                }
+                cur_pos.a += lines;
+                cur_pos.b = next - line_start + 1;
+                line_comment = false;
+            }
+            else
+            {
+                cur_pos.b += skipped;
+            }
+            c += skipped;
+            dc += skipped;
+            i += skipped;
+            continue;
+        }
+
+        // NOTE jump to the next character that can change the state, everything in between
+        // is either copied or blanked, directives only matter at the start of a line
+        int classes = SCAN_NEWLINE;
+        bool copy = false;
+        if(check_pound_ifs && IsPoundIfHidden(&parser))
+        {
+        }
+        else if(line_comment)
+        {
+        }
+        else if(multiline_comment)
+        {
+            classes |= SCAN_SLASH;
+        }
+        else if(info.current_string == '\0')
+        {
+            classes |= SCAN_STAR | SCAN_SLASH | SCAN_QUOTE | (check_pound_ifs ? SCAN_POUND : 0);
+            copy = true;
+        }
+        else
+        {
+            classes |= SCAN_QUOTE;
+        }
+
+        const char *next = ScanNext(&scanner, c + 1, classes);
+        size_t skipped = next - (c + 1);
+        if(copy)
+        {
+            memcpy(dc + 1, c + 1, skipped);
+        }
+        else
+        {
+            memset(dc + 1, ' ', skipped);
+        }
+        cur_pos.b += skipped;
+        c += skipped;
+        dc += skipped;
+        i += skipped;
+    }
+
+    if(run && run->exit)
+    {
+        run->exit->offset = c - string->data;
+        run->exit->line = cur_pos.a;
+        run->exit->info = info;
+        run->exit->comment_depth = (multiline_comment != NULL);
+        if(check_pound_ifs)
+        {
+            *run->exit->pound_ifs = parser;
+        }
+    }
+
+    if(run && run->converged)
+    {
+        CopyConvergedCheckpoints(run, 0);
+    }
+}
+
+void MaskCPass(MaskPass *pass, IncrementalRun *run, const char *old_buffer)
+{
+    MaskCFile(pass->string, pass->buffer, pass->check_pound_ifs, pass->defines, run, old_buffer);
+}
+
+// NOTE every filetype is parsed the same way once its mask pass is picked, the <> are only
+// checked with terminators. old and edit are NULL for a full parse, chunks is only set for a
+// full parse that is worth doing in parallel
+void ParseMaskedFile(MaskPass *pass, const char *terminators, bool check_templates, ParseState *state,
+                     ParseState *old, ParseEdit *edit, ParseChunks *chunks)
+{
+    if(!old)
+    {
+        edit = NULL;
+    }
+    if(!terminators)
+    {
+        check_templates = false;
+    }
+
+    String *string = pass->string;
+
+    RunStats *stats = state->stats;
+    uint64_t start = StartPhase(stats);
+
+    state->masked = PushArray(&state->arena, char, string->length + 1);
+    state->masked[string->length] = 0;
+
+    int dirty_line = edit ? edit->start_pos.a : 0;
+
+    IncrementalRun mask_run;
+    StartRun(&mask_run, &state->mask_checkpoints, old ? &old->mask_checkpoints : NULL,
+             edit, dirty_line, edit ? edit->new_end + 1 : 0);
+    pass->buffer = state->masked;
+    pass->chunks = chunks;
+    if(chunks)
+    {
+        MaskParallel(pass, &state->mask_checkpoints);
+    }
+    else
+    {
+        pass->mask(pass, &mask_run, old ? old->masked : NULL);
+    }
+    FinishPhase(stats, PHASE_MASK, start, &mask_run, string->length);
+    if(stats)
+    {
+        stats->hidden_blocks += mask_run.num_hidden_blocks;
+    }
+
+    if(IsSuperseded(state->job))
+    {
+        return;
+    }
+
+    // NOTE over the latency budget the <> are not checked, the bracket pass can't resume from a
+    // run that checked them then
+    if(CheckBudget(state->budget, 1, check_templates ? 3 : 2) >= BUDGET_NO_TEMPLATES && check_templates)
+    {
+        check_templates = false;
+        old = NULL;
+    }
+
+    // NOTE the later passes can only stop where the masked buffer is the same again
+    size_t converge_after = mask_run.converged ? mask_run.converged_offset : string->length + 1;
+    int index_shift = 0;
+
+    if(check_templates)
+    {
+        start = StartPhase(stats);
+        IncrementalRun angle_run;
+        StartRun(&angle_run, &state->angle_checkpoints, old ? &old->angle_checkpoints : NULL,
+                 edit, dirty_line, converge_after);
+        state->generics = ParseAngleBrackets(state->masked, string->length, &state->arena, terminators, &angle_run, old ? &old->generics : NULL);
+        FinishPhase(stats, PHASE_ANGLE, start, &angle_run, string->length);
+
+        dirty_line = angle_run.dirty_line;
+        converge_after = angle_run.converged ? angle_run.converged_offset : string->length + 1;
+        index_shift = angle_run.result_shift;
+    }
+
+    // NOTE at the viewport level ParseSource parses the window instead
+    if(IsSuperseded(state->job) || CheckBudget(state->budget, check_templates ? 2 : 1, check_templates ? 3 : 2) >= BUDGET_VIEWPORT)
+    {
+        return;
+    }
+
+    CharPair template_pair;
+    template_pair.a = '<';
+    template_pair.b = '>';
+
+    start = StartPhase(stats);
+    IncrementalRun bracket_run;
+    StartRun(&bracket_run, &state->bracket_checkpoints, old ? &old->bracket_checkpoints : NULL,
+             edit, dirty_line, converge_after);
+    bracket_run.index_shift = index_shift;
+    if(chunks)
+    {
+        state->result = ParseGenericFileParallel(state->masked, string->length, &state->arena, &state->line_starts,
+                                                 state->generics, template_pair, chunks, &state->bracket_checkpoints);
+    }
+    else
+    {
+        state->result = ParseGenericFile(state->masked, string->length, &state->arena, &state->line_starts,
+                                         state->generics, template_pair, &bracket_run, old ? &old->result : NULL,
+                                         old ? &old->line_starts : NULL);
+    }
+    FinishPhase(stats, PHASE_BRACKETS, start, &bracket_run, string->length);
+}
+
+void ParseCFile(String *string, bool check_templates, bool check_pound_ifs, PoundIfDefines *defines,
+                ParseState *state, ParseState *old = NULL, ParseEdit *edit = NULL, ParseChunks *chunks = NULL)
+{
+    MaskPass pass = {string, NULL, check_pound_ifs, defines, NULL, MaskCPass, NULL};
+    ParseMaskedFile(&pass, C_TEMPLATE_TERMINATORS, check_templates, state, old, edit, chunks);
+}
+
+void RustContinueString(StringParsingInfo *info, const char *c)
+{
+    if(info->current_string == '\'' && *c == 'x' && *(c - 1) == '\\')
+    {
+        info->current_string = 'x';
+    }
+    // NOTE the first check checks for the lifetime specifier
+    else if((info->current_string == '\'' && info->current_string_count == 1) ||
+            ((info->current_string == '\'' && *c == '\'') &&
+            (*(c - 1) != '\\' || *(c - 2) == '\\')))
+    {
+        info->current_string = '\0';
+        info->current_string_count = 0;
+        info->closed_string = true;
+    }
+    else if((info->current_string == '\"' && *c == '\"') &&
+            (*(c - 1) != '\\' || *(c - 2) == '\\'))
+    {
+        info->current_string = '\0';
+        info->current_string_count = 0;
+        info->closed_string = true;
+    }
+    else if(info->current_string == 'x' && (*c == '\'' || *c < '0' || *c > '9'))
+    {
+        info->current_string = '\0';
+        info->current_string_count = 0;
+        info->closed_string = true;
+    }
+    else if(*(c) != '\\' || *(c - 1) == '\\')
+    {
+        info->current_string_count += 1;
+    }
+}
+
+bool RustCheckCloseMultilineComment(const char *c, const char *multiline_comment)
+{
+    return (*c == '/' && *(c - 1) == '*' && c != multiline_comment + 1);
+}
+
+bool RustCheckStartMultilineComment(const char *c, const char *buffer, const char *last_closed_comment)
+{
+    return (last_closed_comment != (c - 1) && *c == '*' && c != buffer && *(c - 1) == '/');
+}
+
+bool RustCheckStartLineComment(const char *c, const char *buffer, const char *last_closed_comment)
+{
+    return (last_closed_comment != (c - 1) && *c == '/' && c != buffer && *(c - 1) == '/');
+}
+
+void MaskRustFile(String *string, char *buffer, IncrementalRun *run, const char *old_buffer)
+{
+    IntPair cur_pos = { 1, 1 };
+
+    StringParsingInfo info;
+    info.current_string = '\0';
+    info.current_string_count = 0;
+
+    // NOTE only the innermost opening matters, it's used to not close the comment on "/*/"
+    int comment_depth = 0;
+    const char *comment_start = NULL;
+
+    bool line_comment = false;
+    const char *last_closed_comment = 0;
+
+    size_t start_offset = 0;
+
+    if(run && run->start)
+    {
+        Checkpoint *start = run->start;
+        start_offset = start->offset;
+        if(old_buffer && old_buffer != buffer)
+        {
+            memcpy(buffer, old_buffer, start_offset);
+        }
+
+        cur_pos.a = start->line;
+        info = start->info;
+        comment_depth = start->comment_depth;
+        comment_start = string->data + start_offset - 2;
+    }
+
+    char *dc = buffer + start_offset - (run ? run->window_offset : 0);
+    size_t end_offset = (run && run->end_offset) ? run->end_offset : string->length;
+    const char *end = string->data + end_offset;
+
+    Scanner scanner;
+    StartScanner(&scanner, string->data + start_offset, end_offset - start_offset,
+                 SCAN_QUOTE | SCAN_BACKSLASH | SCAN_SLASH | SCAN_STAR | SCAN_NEWLINE);
+
+    const char *c = string->data + start_offset;
+    for(; c < end && *c != '\0'; c++, dc++)
+    {
+        bool should_check_char = false;
+
+        info.closed_string = false;
+
+        if(*c == '\n')
+        {
+            cur_pos.a++;
+            cur_pos.b = 1;
+            line_comment = false;
+
+            should_check_char = true;
+
+            if(run)
+            {
+                size_t offset = c + 1 - string->data;
+                Checkpoint *old = FindConvergence(run, offset, cur_pos.a);
+                if(old && old->info.current_string == info.current_string &&
+                   old->info.current_string_count == info.current_string_count &&
+                   old->comment_depth == comment_depth)
+                {
+                    *dc = *c;
+                    if(old_buffer != buffer)
+                    {
+                        memcpy(dc + 1, old_buffer + old->offset, string->length - offset);
+                    }
+                    Converge(run, old, offset);
+                    break;
+                }
+                if(ShouldSaveCheckpoint(run, cur_pos.a))
+                {
+                    Checkpoint *checkpoint = SaveCheckpoint(run, offset, cur_pos.a);
+                    checkpoint->info = info;
+                    checkpoint->comment_depth = comment_depth;
+                }
+            }
+        }
+        else
+        {
+            CharPosition p = {};
+            p.c = *c;
+            p.pair = cur_pos;
+            if(line_comment)
+            {
+            }
+            else if(info.current_string == '\0' && RustCheckStartMultilineComment(c, string->data, last_closed_comment))
+            {
+                comment_start = c;
+                comment_depth++;
+            }
+            else if(comment_depth > 0)
+            {
+                if(RustCheckCloseMultilineComment(c, comment_start))
+                {
+                    comment_depth--;
+                    last_closed_comment = c;
+                }
+            }
+            else if(info.current_string == '\0' && RustCheckStartLineComment(c, string->data, last_closed_comment))
+            {
+                line_comment = true;
+            }
+            else
+            {
+                if(info.current_string)
+                {
+                    RustContinueString(&info, c);
+                }
+                if(info.current_string == '\0')
+                {
+                    should_check_char = true;
+                    if(!info.closed_string && (p.c == '\'' || p.c == '\"'))
+                    {
+                        info.current_string = *c;
+                    }
+                }
+                cur_pos.b++;
+            }
+        }
+
+        if(!should_check_char)
+        {
+            *dc = ' ';
+        }
+        else
+        {
+            *dc = *c;
+        }
+
+        // NOTE jump to the next character that can change the state, everything in between
+        // is either copied or blanked, inside char literals every character counts
+        int classes = SCAN_NEWLINE;
+        bool copy = false;
+        if(line_comment)
+        {
+        }
+        else if(comment_depth > 0)
+        {
+            classes |= SCAN_STAR | SCAN_SLASH;
+        }
+        else if(info.current_string == '\"')
+        {
+            classes |= SCAN_QUOTE | SCAN_BACKSLASH;
+        }
+        else if(info.current_string == '\0')
+        {
+            classes |= SCAN_STAR | SCAN_SLASH | SCAN_QUOTE;
+            copy = true;
+        }
+        else
+        {
+            continue;
+        }
+
+        const char *next = ScanNext(&scanner, c + 1, classes);
+        size_t skipped = next - (c + 1);
+        if(copy)
+        {
+            memcpy(dc + 1, c + 1, skipped);
+        }
+        else
+        {
+            memset(dc + 1, ' ', skipped);
+        }
+        if(info.current_string == '\"')
+        {
+            info.current_string_count += skipped;
+        }
+        if(!line_comment && comment_depth == 0)
+        {
+            cur_pos.b += skipped;
+        }
+        c += skipped;
+        dc += skipped;
+    }
+
+    if(run && run->exit)
+    {
+        run->exit->offset = c - string->data;
+        run->exit->line = cur_pos.a;
+        run->exit->info = info;
+        run->exit->comment_depth = comment_depth;
+    }
+
+    if(run && run->converged)
+    {
+        CopyConvergedCheckpoints(run, 0);
+    }
+}
+
+void MaskRustPass(MaskPass *pass, IncrementalRun *run, const char *old_buffer)
+{
+    MaskRustFile(pass->string, pass->buffer, run, old_buffer);
+}
+
+void ParseRustFile(String *string, bool check_generics, ParseState *state,
+                   ParseState *old = NULL, ParseEdit *edit = NULL, ParseChunks *chunks = NULL)
+{
+    MaskPass pass = {string, NULL, false, NULL, NULL, MaskRustPass, NULL};
+    ParseMaskedFile(&pass, RUST_GENERIC_TERMINATORS, check_generics, state, old, edit, chunks);
+}
+
+// NOTE: the languages besides c, cpp and rust come from the languages file, every one is
+// compiled to a table driven lexer with a state for every place the lexer can be at (code,
+// inside a comment or string, or part way through a delimiter) and a transition for every
+// state and class of bytes, so the masking is one lookup per byte whatever the language
+#define LEXER_MAX_DELIMITER 8
+#define LEXER_MAX_CONSTRUCTS 32
+#define LEXER_MAX_FILETYPES 8
+#define LEXER_MAX_NESTING 8
+#define LEXER_MAX_STATES 4096
+
+#if LEXER_MAX_DELIMITER > FUSED_HOLD_BACK
+#error "the fused pass has to hold back the longest delimiter"
+#endif
+
+enum LexerConstructKind
+{
+    CONSTRUCT_LINE_COMMENT,
+    CONSTRUCT_BLOCK_COMMENT,
+    CONSTRUCT_NESTED_COMMENT,
+    CONSTRUCT_STRING,
+    CONSTRUCT_CHAR_PREFIX,
+};
+
+struct LexerConstruct
+{
+    LexerConstructKind kind;
+    char open[LEXER_MAX_DELIMITER + 1];
+    char close[LEXER_MAX_DELIMITER + 1];
+    char escape;
+};
+
+// NOTE region 0 is code, otherwise it's the construct the lexer is in plus one, pending are
+// the characters read so far of what can still be a delimiter
+struct LexerState
+{
+    int region;
+    int depth;
+    bool escape;
+    char pending[LEXER_MAX_DELIMITER];
+    int pending_len;
+};
+
+// NOTE count is how many characters the transition writes, the pending ones are written again
+// once it's known whether they were a delimiter, bit k of blank_mask is for the character k
+// places before the current one
+struct LexerTransition
+{
+    uint16_t next;
+    uint8_t count;
+    uint8_t blank_mask;
+};
+
+struct Language
+{
+    char *filetypes[LEXER_MAX_FILETYPES];
+    int num_filetypes;
+
+    LexerConstruct constructs[LEXER_MAX_CONSTRUCTS];
+    int num_constructs;
+
+    // NOTE <> are brackets too when the terminators are set, see ParseAngleBrackets
+    char generic_terminators[LEXER_MAX_DELIMITER + 1];
+
+    uint8_t byte_classes[256];
+    int num_classes;
+    int num_states;
+    LexerTransition *transitions;
+
+    Language *next;
+};
+
+struct LexerCandidate
+{
+    const char *delimiter;
+    int length;
+    int construct;
+    bool close;
+};
+
+// NOTE the delimiters that can come next, the closing one first
+int GetLexerCandidates(Language *language, LexerState *state, LexerCandidate *candidates)
+{
+    int count = 0;
+    if(state->region == 0)
+    {
+        for(int k = 0; k < language->num_constructs; ++k)
+        {
+            LexerConstruct *construct = &language->constructs[k];
+            candidates[count++] = {construct->open, (int)strlen(construct->open), k, false};
+        }
+        return count;
+    }
+
+    int k = state->region - 1;
+    LexerConstruct *construct = &language->constructs[k];
+    if(construct->kind == CONSTRUCT_LINE_COMMENT)
+    {
+        candidates[count++] = {"\n", 1, k, true};
+    }
+    else
+    {
+        candidates[count++] = {construct->close, (int)strlen(construct->close), k, true};
+    }
+    if(construct->kind == CONSTRUCT_NESTED_COMMENT && state->depth < LEXER_MAX_NESTING)
+    {
+        candidates[count++] = {construct->open, (int)strlen(construct->open), k, false};
+    }
+
+    return count;
+}
+
+LexerState ApplyLexerCandidate(LexerState *state, LexerCandidate *candidate)
+{
+    LexerState result = {};
+    if(!candidate->close)
+    {
+        result.region = candidate->construct + 1;
+        result.depth = (state->region == 0) ? 1 : state->depth + 1;
+    }
+    else if(state->depth > 1)
+    {
+        result.region = state->region;
+        result.depth = state->depth - 1;
+    }
+
+    return result;
+}
+
+// NOTE feeds c to the lexer, the longest delimiter wins so the characters that can still be
+// one are kept pending until they can't, then the ones that were not are fed again after it,
+// blank gets whether each pending character and c ends up blanked
+LexerState FeedLexer(Language *language, LexerState state, char c, bool *blank)
+{
+    char chars[LEXER_MAX_DELIMITER];
+    int n = state.pending_len;
+    memcpy(chars, state.pending, n);
+    chars[n++] = c;
+
+    bool in_code = (state.region == 0);
+    LexerConstruct *construct = in_code ? NULL : &language->constructs[state.region - 1];
+    if(state.escape)
+    {
+        blank[0] = true;
+        state.escape = false;
+        return state;
+    }
+    if(construct && construct->kind == CONSTRUCT_CHAR_PREFIX)
+    {
+        blank[0] = true;
+        return {};
+    }
+    if(construct && construct->escape && n == 1 && c == construct->escape)
+    {
+        blank[0] = true;
+        state.escape = true;
+        return state;
+    }
+
+    LexerCandidate candidates[LEXER_MAX_CONSTRUCTS + 1];
+    int num_candidates = GetLexerCandidates(language, &state, candidates);
+
+    LexerCandidate *best = NULL;
+    for(int i = 0; i < num_candidates; ++i)
+    {
+        LexerCandidate *candidate = &candidates[i];
+        if(candidate->length > n && memcmp(candidate->delimiter, chars, n) == 0)
+        {
+            memcpy(state.pending, chars, n);
+            state.pending_len = n;
+            for(int k = 0; k < n; ++k)
+            {
+                blank[k] = !in_code;
+            }
+            return state;
+        }
+        if(candidate->length <= n && memcmp(candidate->delimiter, chars, candidate->length) == 0 &&
+           (!best || candidate->length > best->length))
+        {
+            best = candidate;
+        }
+    }
+
+    LexerState next = state;
+    next.pending_len = 0;
+    int consumed = 1;
+    if(best)
+    {
+        next = ApplyLexerCandidate(&state, best);
+        consumed = best->length;
+        for(int k = 0; k < consumed; ++k)
+        {
+            blank[k] = true;
+        }
+    }
+    else
+    {
+        blank[0] = !in_code;
+    }
+
+    for(int i = consumed; i < n; ++i)
+    {
+        next = FeedLexer(language, next, chars[i], blank + i - next.pending_len);
+    }
+
+    return next;
+}
+
+bool IsSameLexerState(LexerState *a, LexerState *b)
+{
+    return (a->region == b->region && a->depth == b->depth && a->escape == b->escape &&
+            a->pending_len == b->pending_len && memcmp(a->pending, b->pending, a->pending_len) == 0);
+}
+
+// NOTE the bytes that are in no delimiter all behave the same, they share class 0, every
+// other one has its own class, the states are found from the code state by trying every class
+bool CompileLanguage(Language *language)
+{
+    memset(language->byte_classes, 0, sizeof(language->byte_classes));
+    unsigned char representatives[256];
+    int num_classes = 1;
+
+    bool special[256] = {};
+    special['\n'] = true;
+    for(int k = 0; k < language->num_constructs; ++k)
+    {
+        LexerConstruct *construct = &language->constructs[k];
+        for(const char *c = construct->open; *c; ++c)
+        {
+            special[(unsigned char)*c] = true;
+        }
+        for(const char *c = construct->close; *c; ++c)
+        {
+            special[(unsigned char)*c] = true;
+        }
+        special[(unsigned char)construct->escape] = true;
+    }
+    special[0] = false;
+
+    representatives[0] = 0;
+    for(int b = 1; b < 256; ++b)
+    {
+        if(special[b])
+        {
+            language->byte_classes[b] = num_classes;
+            representatives[num_classes++] = b;
+        }
+        else if(representatives[0] == 0)
+        {
+            representatives[0] = b;
+        }
+    }
+    language->num_classes = num_classes;
+
+    LexerState *states = (LexerState *)malloc(LEXER_MAX_STATES * sizeof(LexerState));
+    LexerTransition *transitions = (LexerTransition *)malloc(LEXER_MAX_STATES * num_classes * sizeof(LexerTransition));
+    states[0] = {};
+    int num_states = 1;
+
+    bool ok = true;
+    for(int s = 0; s < num_states && ok; ++s)
+    {
+        for(int k = 0; k < num_classes; ++k)
+        {
+            bool blank[LEXER_MAX_DELIMITER] = {};
+            LexerState next = FeedLexer(language, states[s], (char)representatives[k], blank);
+
+            int id = 0;
+            while(id < num_states && !IsSameLexerState(&states[id], &next))
+            {
+                id++;
+            }
+            if(id == num_states)
+            {
+                if(num_states == LEXER_MAX_STATES)
+                {
+                    ok = false;
+                    break;
+                }
+                states[num_states++] = next;
+            }
+
+            int count = states[s].pending_len + 1;
+            uint8_t blank_mask = 0;
+            for(int i = 0; i < count; ++i)
+            {
+                blank_mask |= blank[count - 1 - i] << i;
+            }
+            transitions[s * num_classes + k] = {(uint16_t)id, (uint8_t)count, blank_mask};
+        }
+    }
+
+    free(states);
+    if(!ok)
+    {
+        free(transitions);
+        return false;
+    }
+
+    language->num_states = num_states;
+    language->transitions = transitions;
+
+    return true;
+}
+
+Language *FindLanguage(Language *languages, const char *filetype)
+{
+    for(Language *language = languages; language; language = language->next)
+    {
+        for(int i = 0; i < language->num_filetypes; ++i)
+        {
+            if(language->transitions && strcmp(language->filetypes[i], filetype) == 0)
+            {
+                return language;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void Free(Language *languages)
+{
+    while(languages)
+    {
+        Language *next = languages->next;
+        for(int i = 0; i < languages->num_filetypes; ++i)
+        {
+            free(languages->filetypes[i]);
+        }
+        free(languages->transitions);
+        free(languages);
+        languages = next;
+    }
+}
+
+// NOTE a blanked newline stays a newline so the lines don't move, a delimiter is never split
+// by one so the pending characters are always on the line being lexed
+void MaskLanguageFile(String *string, char *buffer, Language *language, IncrementalRun *run, const char *old_buffer)
+{
+    int line = 1;
+    int state = 0;
+    size_t start_offset = 0;
+
+    if(run && run->start)
+    {
+        Checkpoint *start = run->start;
+        start_offset = start->offset;
+        if(old_buffer && old_buffer != buffer)
+        {
+            memcpy(buffer, old_buffer, start_offset);
+        }
+
+        line = start->line;
+        state = start->lexer_state;
+    }
+
+    size_t end_offset = (run && run->end_offset) ? run->end_offset : string->length;
+    const unsigned char *c = (const unsigned char *)string->data + start_offset;
+    const unsigned char *end = (const unsigned char *)string->data + end_offset;
+    char *dc = buffer + start_offset - (run ? run->window_offset : 0);
+
+    const uint8_t *byte_classes = language->byte_classes;
+    const LexerTransition *transitions = language->transitions;
+    int num_classes = language->num_classes;
+
+    for(; c < end && *c != '\0'; c++, dc++)
+    {
+        unsigned char ch = *c;
+        LexerTransition transition = transitions[state * num_classes + byte_classes[ch]];
+        *dc = ((transition.blank_mask & 1) && ch != '\n') ? ' ' : ch;
+        for(int k = 1; k < transition.count; ++k)
+        {
+            dc[-k] = ((transition.blank_mask >> k) & 1) ? ' ' : c[-k];
+        }
+        state = transition.next;
+
+        if(ch == '\n' && run)
+        {
+            line++;
+            size_t offset = c + 1 - (const unsigned char *)string->data;
+            Checkpoint *old = FindConvergence(run, offset, line);
+            if(old && old->lexer_state == state)
+            {
+                if(old_buffer != buffer)
+                {
+                    memcpy(dc + 1, old_buffer + old->offset, string->length - offset);
+                }
+                Converge(run, old, offset);
+                c++;
+                break;
+            }
+            if(ShouldSaveCheckpoint(run, line))
+            {
+                Checkpoint *checkpoint = SaveCheckpoint(run, offset, line);
+                checkpoint->lexer_state = state;
+            }
+        }
+    }
+
+    if(run && run->exit)
+    {
+        run->exit->offset = c - (const unsigned char *)string->data;
+        run->exit->line = line;
+        run->exit->info = {};
+        run->exit->comment_depth = 0;
+        run->exit->lexer_state = state;
+    }
+
+    if(run && run->converged)
+    {
+        CopyConvergedCheckpoints(run, 0);
+    }
+}
+
+void MaskLanguagePass(MaskPass *pass, IncrementalRun *run, const char *old_buffer)
+{
+    MaskLanguageFile(pass->string, pass->buffer, pass->language, run, old_buffer);
+}
+
+void ParseLanguageFile(String *string, Language *language, bool check_generics, ParseState *state,
+                       ParseState *old = NULL, ParseEdit *edit = NULL, ParseChunks *chunks = NULL)
+{
+    MaskPass pass = {string, NULL, false, NULL, NULL, MaskLanguagePass, language};
+    ParseMaskedFile(&pass, language->generic_terminators[0] ? language->generic_terminators : NULL,
+                    check_generics, state, old, edit, chunks);
+}
+
+#define BUFFER_SIZE (64 * 1024)
+
+// NOTE the counters that come from the results of a run, every '<' left in the masked buffer
+// is a template candidate and the ones that didn't end up in a pair were rejected
+void CollectStats(RunStats *stats, ParseState *state, size_t length, int num_chunks)
+{
+    stats->num_pairs = state->result.len;
+    stats->num_chunks = num_chunks;
+    stats->fallback = state->fallback;
+
+    stats->max_depth = 0;
+    for(int i = 0; i < state->result.len; ++i)
+    {
+        if(state->result.level[i] + 1 > stats->max_depth)
+        {
+            stats->max_depth = state->result.level[i] + 1;
+        }
+    }
+
+    // NOTE the fused pass keeps no masked buffer, it counts them as it goes
+    if(!state->masked)
+    {
+        return;
+    }
+
+    stats->template_candidates = 0;
+    stats->templates_rejected = 0;
+    if(stats->phase_ran[PHASE_ANGLE] || state->generics.len > 0)
+    {
+        for(const char *c = state->masked; (c = (const char *)memchr(c, '<', state->masked + length - c)); ++c)
+        {
+            stats->template_candidates++;
+        }
+        stats->templates_rejected = stats->template_candidates - state->generics.len / 2;
+    }
+}
+
+struct RainbowOptions
+{
+    const char *buffile;
+    const char *timestamp;
+    char mode;
+
+    IntPair cursor_pair;
+    IntPair window_top;
+    IntPair window_bottom;
+
+    const char *filetype;
+
+    char check_templates;
+    char check_pound_ifs;
+
+    const char **colors;
+    int num_colors;
+    const char **background_colors;
+    int num_background_colors;
+
+    PoundIfDefines defines;
+
+    // NOTE not arguments, set by the callers that can parse a large buffer in parallel and the
+    // ones that loaded the languages file
+    int num_threads;
+    Language *languages;
+    // NOTE set by the server, its next run on the buffer resumes from the masked buffer
+    bool keep_masked;
+};
+
+// NOTE the lines above and below the window that are highlighted too, so that scrolling a bit
+// shows them before the next update
+#define WINDOW_MARGIN_LINES 30
+
+// NOTE the cursor is either a line.column or the caret register as kakoune gives it,
+// buffer@timestamp@main followed by the selections, then it's the main selection
+IntPair ParseCursor(const char *c)
+{
+    const char *header = strrchr(c, '@');
+    if(header)
+    {
+        int main_selection = ParseInt(header + 1, NULL);
+        c = header;
+        for(int i = 0; i <= main_selection && (c = strchr(c, ' ')); ++i)
+        {
+            c++;
+        }
+        if(!c)
+        {
+            return {};
+        }
+    }
+
+    return ParsePair(c);
+}
+
+// NOTE the window is either its top and its size as two line.column arguments or the
+// %val{window_range} of kakoune in one argument, line column height width
+bool ParseOptions(int argc, const char **argv, RainbowOptions *options)
+{
+    if(argc < 9)
+    {
+        return false;
+    }
+
+    options->buffile = argv[1];
+    options->timestamp = argv[2];
+    options->mode = argv[3][0];
+
+    options->cursor_pair = ParseCursor(argv[4]);
+
+    int i = 5;
+    IntPair window_top = ParsePair(argv[i]);
+    IntPair window_size;
+    const char *window_range = strchr(argv[i], ' ');
+    if(window_range && strchr(window_range + 1, ' '))
+    {
+        window_size = ParsePair(strchr(window_range + 1, ' ') + 1);
+        i++;
+    }
+    else if(argc >= 10)
+    {
+        window_size = ParsePair(argv[i + 1]);
+        i += 2;
+    }
+    else
+    {
+        return false;
+    }
+
+    options->filetype = argv[i++];
+
+    IntPair window_bottom;
+    window_bottom.a = window_top.a + window_size.a;
+    window_bottom.b = window_top.b + window_size.b;
+
+    window_top.a -= WINDOW_MARGIN_LINES;
+    window_bottom.a += WINDOW_MARGIN_LINES;
+
+    options->window_top = window_top;
+    options->window_bottom = window_bottom;
+
+    options->check_templates = argv[i++][0];
+    options->check_pound_ifs = argv[i++][0];
+
+    options->colors = argv + i;
+    options->num_colors = 0;
+    for(; i < argc && argv[i][0] != '!'; ++i)
+    {
+        options->num_colors++;
+    }
+
+    // NOTE the background colors start with the '!', the defines come after the next one
+    options->background_colors = argv + i;
+    options->num_background_colors = 0;
+    for(; i < argc && (argv[i][0] != '!' || options->num_background_colors == 0); ++i)
+    {
+        options->num_background_colors++;
+    }
+
+    options->defines.names = argv + i + 1;
+    options->defines.count = (i < argc) ? argc - i - 1 : 0;
+
+    options->num_threads = 1;
+    options->languages = NULL;
+    options->keep_masked = false;
+
+    return true;
+}
+
+// NOTE when stdin is redirected from a file its size is known up front, a pipe is read into a
+// buffer that doubles, realloc moves the pages of large buffers instead of copying them
+String ReadSource(int fd)
+{
+    String source_code = {};
+
+    size_t buffer_size = BUFFER_SIZE;
+    struct stat file_info;
+    if(fstat(fd, &file_info) == 0 && S_ISREG(file_info.st_mode) && file_info.st_size > 0)
+    {
+        // NOTE one more so the read that sees the end doesn't have to grow it
+        buffer_size = file_info.st_size + 1;
+    }
+
+    char *string = (char *)malloc(buffer_size + 1);
+    size_t length = 0;
+    while(string)
+    {
+        if(length == buffer_size)
+        {
+            buffer_size *= 2;
+            char *result = (char *)realloc(string, buffer_size + 1);
+            if(!result)
+            {
+                break;
+            }
+            string = result;
+        }
+
+        ssize_t bytes_read = read(fd, string + length, buffer_size - length);
+        if(bytes_read <= 0)
+        {
+            break;
+        }
+        length += bytes_read;
+    }
+
+    if(string)
+    {
+        string[length] = 0;
+    }
+
+    source_code.data = string;
+    source_code.length = length;
+
+    return source_code;
+}
+
+// NOTE the parsers need a 0 after the end, the file is mapped over an anonymous mapping one
+// byte larger than it, so past the end of the file everything reads as 0 even when its size
+// is a multiple of the page size
+String MapSource(const char *path)
+{
+    String source_code = {};
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return source_code;
+    }
+
+    struct stat file_info;
+    if(fstat(fd, &file_info) != 0 || !S_ISREG(file_info.st_mode))
+    {
+        close(fd);
+        return source_code;
+    }
+
+    size_t length = file_info.st_size;
+    size_t mapped_size = length + 1;
+    char *data = (char *)mmap(NULL, mapped_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(data == MAP_FAILED)
+    {
+        close(fd);
+        return source_code;
+    }
+
+    if(length > 0)
+    {
+        int flags = MAP_PRIVATE | MAP_FIXED;
+#ifdef MAP_POPULATE
+        flags |= MAP_POPULATE;
+#endif
+        if(mmap(data, length, PROT_READ, flags, fd, 0) == MAP_FAILED)
+        {
+            munmap(data, mapped_size);
+            close(fd);
+            return source_code;
+        }
+        madvise(data, length, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    source_code.data = data;
+    source_code.length = length;
+    source_code.mapped_size = mapped_size;
+
+    return source_code;
+}
+
+// NOTE with --mmap the buffer is the same as its file, stdin is only read when it can't be mapped
+String LoadSource(const char *buffile, bool map_file)
+{
+    if(map_file && buffile)
+    {
+        String source_code = MapSource(buffile);
+        if(source_code.data)
+        {
+            return source_code;
+        }
+    }
+
+    return ReadSource(STDIN_FILENO);
+}
+
+void Free(String *source_code)
+{
+    if(source_code->mapped_size)
+    {
+        munmap(source_code->data, source_code->mapped_size);
+    }
+    else
+    {
+        free(source_code->data);
+    }
+    *source_code = {};
+}
+
+// NOTE: with --stream the buffer is parsed while it is still being read, a thread reads stdin
+// into a ring of blocks and the fused pass copies its windows out of them, so reading and
+// parsing overlap and the memory taken by the input doesn't grow with the size of the buffer
+#define STREAM_BLOCK_SIZE (64 * 1024)
+#define STREAM_NUM_BLOCKS 16
+
+struct SourceStream
+{
+    int fd;
+    pthread_t thread;
+    bool started;
+
+    // NOTE the reader fills block head % STREAM_NUM_BLOCKS and the parser empties block tail,
+    // the mutex only guards the counters, the blocks are copied outside of it
+    char *blocks;
+    size_t lengths[STREAM_NUM_BLOCKS];
+    uint64_t head;
+    uint64_t tail;
+    bool done;
+    bool stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    // NOTE what was taken out of the blocks, from the start of the last window on, the
+    // FUSED_HOLD_BACK bytes before it are the end of the window before
+    char *allocation;
+    size_t size;
+    size_t length;
+    size_t window_length;
+
+    // NOTE the time the parser waited for the blocks, the part of the read that isn't overlapped
+    RunStats *stats;
+    bool failed;
+};
+
+void *ReadStream(void *data)
+{
+    SourceStream *stream = (SourceStream *)data;
+    for(;;)
+    {
+        pthread_mutex_lock(&stream->mutex);
+        while(stream->head - stream->tail == STREAM_NUM_BLOCKS && !stream->stop)
+        {
+            pthread_cond_wait(&stream->cond, &stream->mutex);
+        }
+        bool stop = stream->stop;
+        pthread_mutex_unlock(&stream->mutex);
+        if(stop)
+        {
+            break;
+        }
+
+        // NOTE a block is filled as far as one read goes, so the parser gets it right away
+        int index = stream->head % STREAM_NUM_BLOCKS;
+        ssize_t bytes_read = read(stream->fd, stream->blocks + (size_t)index * STREAM_BLOCK_SIZE, STREAM_BLOCK_SIZE);
+
+        pthread_mutex_lock(&stream->mutex);
+        if(bytes_read > 0)
+        {
+            stream->lengths[index] = bytes_read;
+            stream->head++;
+        }
+        else
+        {
+            stream->done = true;
+        }
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->mutex);
+        if(bytes_read <= 0)
+        {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+bool StartStream(SourceStream *stream, int fd, RunStats *stats)
+{
+    *stream = {};
+    stream->fd = fd;
+    stream->stats = stats;
+    stream->blocks = (char *)malloc((size_t)STREAM_NUM_BLOCKS * STREAM_BLOCK_SIZE);
+    stream->size = 2 * FUSED_WINDOW_LENGTH;
+    stream->allocation = (char *)malloc(FUSED_HOLD_BACK + stream->size + 1);
+    if(!stream->blocks || !stream->allocation)
+    {
+        return false;
+    }
+    memset(stream->allocation, ' ', FUSED_HOLD_BACK);
+    stream->allocation[FUSED_HOLD_BACK] = 0;
+
+    pthread_mutex_init(&stream->mutex, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+    stream->started = (pthread_create(&stream->thread, NULL, ReadStream, stream) == 0);
+
+    return stream->started;
+}
+
+// NOTE appends the next block to what was taken, false once the whole input was taken
+bool TakeStreamBlock(SourceStream *stream)
+{
+    uint64_t start = StartPhase(stream->stats);
+    pthread_mutex_lock(&stream->mutex);
+    while(stream->head == stream->tail && !stream->done)
+    {
+        pthread_cond_wait(&stream->cond, &stream->mutex);
+    }
+    bool has_block = (stream->head != stream->tail);
+    pthread_mutex_unlock(&stream->mutex);
+    FinishPhase(stream->stats, PHASE_READ, start, 0);
+    if(!has_block)
+    {
+        return false;
+    }
+
+    int index = stream->tail % STREAM_NUM_BLOCKS;
+    size_t length = stream->lengths[index];
+    if(stream->length + length > stream->size)
+    {
+        size_t size = stream->size * 2;
+        while(size < stream->length + length)
+        {
+            size *= 2;
+        }
+        char *allocation = (char *)realloc(stream->allocation, FUSED_HOLD_BACK + size + 1);
+        if(!allocation)
+        {
+            stream->failed = true;
+            return false;
+        }
+        stream->allocation = allocation;
+        stream->size = size;
+    }
+
+    char *data = stream->allocation + FUSED_HOLD_BACK;
+    memcpy(data + stream->length, stream->blocks + (size_t)index * STREAM_BLOCK_SIZE, length);
+    stream->length += length;
+    data[stream->length] = 0;
+    if(stream->stats)
+    {
+        stream->stats->phase_bytes[PHASE_READ] += length;
+    }
+
+    pthread_mutex_lock(&stream->mutex);
+    stream->tail++;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->mutex);
+
+    return true;
+}
+
+// NOTE the windows are taken in order, so the begin is always where the last one ended
+bool GetStreamWindow(void *source, size_t, String *window, bool *at_end)
+{
+    SourceStream *stream = (SourceStream *)source;
+    char *data = stream->allocation + FUSED_HOLD_BACK;
+
+    // NOTE the rest of the blocks taken for the last window goes to the start
+    if(stream->window_length > 0)
+    {
+        memmove(stream->allocation, data + stream->window_length - FUSED_HOLD_BACK, FUSED_HOLD_BACK);
+        memmove(data, data + stream->window_length, stream->length - stream->window_length + 1);
+        stream->length -= stream->window_length;
+        stream->window_length = 0;
+    }
+
+    size_t searched = FUSED_WINDOW_LENGTH - 1;
+    *at_end = false;
+    while(!stream->window_length)
+    {
+        if(stream->length > searched)
+        {
+            const char *newline = (const char *)memchr(data + searched, '\n', stream->length - searched);
+            if(newline)
+            {
+                // NOTE a window that ends with the input is the last one, as it would be in memory
+                stream->window_length = newline + 1 - data;
+                *at_end = (stream->window_length == stream->length && !TakeStreamBlock(stream));
+                break;
+            }
+            searched = stream->length;
+        }
+
+        if(!TakeStreamBlock(stream))
+        {
+            stream->window_length = stream->length;
+            *at_end = true;
+            break;
+        }
+        data = stream->allocation + FUSED_HOLD_BACK;
+    }
+
+    // NOTE taking a block to find the end can move the allocation
+    *window = {};
+    window->data = stream->allocation + FUSED_HOLD_BACK;
+    window->length = stream->window_length;
+
+    return !stream->failed;
+}
+
+// NOTE a parse that stops early leaves the rest of the input unread, the reader stops after
+// the read it is in
+void Free(SourceStream *stream)
+{
+    if(stream->started)
+    {
+        pthread_mutex_lock(&stream->mutex);
+        stream->stop = true;
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->mutex);
+        pthread_join(stream->thread, NULL);
+        pthread_mutex_destroy(&stream->mutex);
+        pthread_cond_destroy(&stream->cond);
+    }
+    free(stream->blocks);
+    free(stream->allocation);
+    *stream = {};
+}
+
+char *CopyString(const char *string)
+{
+    size_t length = strlen(string);
+    char *copy = (char *)malloc(length + 1);
+    memcpy(copy, string, length + 1);
+    return copy;
+}
+
+// NOTE the languages file is next to the binary
+char *FindLanguagesFile()
+{
+    char path[4096];
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 16);
+    if(length <= 0)
+    {
+        return NULL;
+    }
+    path[length] = 0;
+
+    char *slash = strrchr(path, '/');
+    if(!slash)
+    {
+        return NULL;
+    }
+    strcpy(slash + 1, "languages");
+
+    return CopyString(path);
+}
+
+bool AddLexerConstruct(Language *language, char **tokens, int num_tokens)
+{
+    for(int i = 1; i < num_tokens; ++i)
+    {
+        if(strlen(tokens[i]) > LEXER_MAX_DELIMITER)
+        {
+            return false;
+        }
+    }
+
+    const char *name = tokens[0];
+    LexerConstruct construct = {};
+    if(strcmp(name, "generics") == 0 && num_tokens == 2)
+    {
+        strcpy(language->generic_terminators, tokens[1]);
+        return true;
+    }
+    else if(strcmp(name, "line-comment") == 0 && num_tokens == 2)
+    {
+        construct.kind = CONSTRUCT_LINE_COMMENT;
+    }
+    else if(strcmp(name, "char-prefix") == 0 && num_tokens == 2)
+    {
+        construct.kind = CONSTRUCT_CHAR_PREFIX;
+    }
+    else if(strcmp(name, "block-comment") == 0 && num_tokens == 3)
+    {
+        construct.kind = CONSTRUCT_BLOCK_COMMENT;
+    }
+    else if(strcmp(name, "nested-comment") == 0 && num_tokens == 3)
+    {
+        construct.kind = CONSTRUCT_NESTED_COMMENT;
+    }
+    else if(strcmp(name, "raw-string") == 0 && num_tokens == 3)
+    {
+        construct.kind = CONSTRUCT_STRING;
+    }
+    else if(strcmp(name, "string") == 0 && (num_tokens == 3 || (num_tokens == 4 && !tokens[3][1])))
+    {
+        construct.kind = CONSTRUCT_STRING;
+        construct.escape = (num_tokens == 4) ? tokens[3][0] : 0;
+    }
+    else
+    {
+        return false;
+    }
+
+    if(language->num_constructs == LEXER_MAX_CONSTRUCTS)
+    {
+        return false;
+    }
+
+    strcpy(construct.open, tokens[1]);
+    if(num_tokens > 2)
+    {
+        strcpy(construct.close, tokens[2]);
+    }
+    language->constructs[language->num_constructs++] = construct;
+
+    return true;
+}
+
+// NOTE only the languages used for filetype are compiled, all of them when it's NULL, the lines
+// that can't be parsed are skipped
+Language *LoadLanguages(const char *path, const char *filetype)
+{
+    int fd = path ? open(path, O_RDONLY) : -1;
+    if(fd < 0)
+    {
+        return NULL;
+    }
+    String text = ReadSource(fd);
+    close(fd);
+
+    Language *languages = NULL;
+    Language **last = &languages;
+    Language *language = NULL;
+
+    char *line = text.data;
+    for(int line_number = 1; line && *line; ++line_number)
+    {
+        char *line_end = strchr(line, '\n');
+        if(line_end)
+        {
+            *line_end = 0;
+        }
+
+        char *tokens[LEXER_MAX_FILETYPES + 2];
+        int num_tokens = 0;
+        char *save = NULL;
+        for(char *token = strtok_r(line, " \t\r", &save); token; token = strtok_r(NULL, " \t\r", &save))
+        {
+            if(num_tokens < LEXER_MAX_FILETYPES + 2)
+            {
+                tokens[num_tokens] = token;
+            }
+            num_tokens++;
+        }
+
+        bool ok = true;
+        if(num_tokens == 0 || tokens[0][0] == '#')
+        {
+        }
+        else if(strcmp(tokens[0], "language") == 0)
+        {
+            ok = (num_tokens > 1 && num_tokens <= LEXER_MAX_FILETYPES + 1);
+            language = ok ? (Language *)calloc(1, sizeof(Language)) : NULL;
+            if(language)
+            {
+                for(int i = 1; i < num_tokens; ++i)
+                {
+                    language->filetypes[language->num_filetypes++] = CopyString(tokens[i]);
+                }
+                *last = language;
+                last = &language->next;
+            }
+        }
+        else
+        {
+            ok = (language && num_tokens <= 4 && AddLexerConstruct(language, tokens, num_tokens));
+        }
+        if(!ok)
+        {
+            fprintf(stderr, "rainbower: %s:%d: can't parse the line\n", path, line_number);
+        }
+
+        line = line_end ? line_end + 1 : NULL;
+    }
+    Free(&text);
+
+    for(language = languages; language; language = language->next)
+    {
+        bool used = !filetype;
+        for(int i = 0; i < language->num_filetypes && !used; ++i)
+        {
+            used = (strcmp(language->filetypes[i], filetype) == 0);
+        }
+        if(used && !CompileLanguage(language))
+        {
+            fprintf(stderr, "rainbower: %s: %s has too many states\n", path, language->filetypes[0]);
+        }
+    }
+
+    return languages;
+}
+
+bool HasOwnParser(const char *filetype)
+{
+    return (strcmp(filetype, "c") == 0 || strcmp(filetype, "cpp") == 0 || strcmp(filetype, "rust") == 0);
+}
+
+// NOTE the mask pass of the filetype for the fused pass and the terminators of its <>, false
+// for the filetypes that have nothing to mask
+bool GetFusedMask(RainbowOptions *options, MaskPass *mask, const char **terminators)
+{
+    *mask = {};
+    *terminators = NULL;
+    bool check_templates = (options->check_templates == 'Y');
+    if(strcmp(options->filetype, "c") == 0 || strcmp(options->filetype, "cpp") == 0)
+    {
+        mask->check_pound_ifs = (options->check_pound_ifs == 'Y');
+        mask->defines = &options->defines;
+        mask->mask = MaskCPass;
+        if(check_templates && strcmp(options->filetype, "cpp") == 0)
+        {
+            *terminators = C_TEMPLATE_TERMINATORS;
+        }
+    }
+    else if(strcmp(options->filetype, "rust") == 0)
+    {
+        mask->mask = MaskRustPass;
+        *terminators = check_templates ? RUST_GENERIC_TERMINATORS : NULL;
+    }
+    else if(Language *language = FindLanguage(options->languages, options->filetype))
+    {
+        mask->mask = MaskLanguagePass;
+        mask->language = language;
+        *terminators = (check_templates && language->generic_terminators[0]) ? language->generic_terminators : NULL;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+// NOTE the filetypes without a mask pass only have their windows copied when they are streamed
+void CopyPass(MaskPass *pass, IncrementalRun *run, const char *)
+{
+    String *string = pass->string;
+    const char *end = (const char *)memchr(string->data, '\0', string->length);
+    size_t length = end ? end - string->data : string->length;
+    memcpy(pass->buffer, string->data, length);
+    run->exit->offset = length;
+}
+
+// NOTE the last level of the latency budget, only the lines of the window and its margin are
+// parsed as if they were the whole buffer, without the <>, so what starts above the window is
+// missed. The lines above it still get their line starts so the positions are the same
+void ParseViewport(String *source_code, RainbowOptions *options, ParseState *state)
+{
+    ResetParseState(state);
+    state->fallback = BUDGET_VIEWPORT;
+
+    Arena *arena = &state->arena;
+    OffsetVector line_starts = MakeOffsetVector(arena, 1024);
+    Insert(&line_starts, 0);
+
+    const char *data = source_code->data;
+    const char *end = data + source_code->length;
+    const char *c = data;
+    int top = (options->window_top.a > 1) ? options->window_top.a : 1;
+    while(line_starts.len < top && (c = (const char *)memchr(c, '\n', end - c)))
+    {
+        c++;
+        Insert(&line_starts, (uint32_t)(c - data));
+    }
+    if(line_starts.len < top)
+    {
+        Insert(&line_starts, (uint32_t)source_code->length);
+        state->line_starts = line_starts;
+        return;
+    }
+
+    size_t begin = line_starts.array[top - 1];
+    c = data + begin;
+    for(int line = top; line <= options->window_bottom.a && c; ++line)
+    {
+        c = (const char *)memchr(c, '\n', end - c);
+        c = c ? c + 1 : NULL;
+    }
+
+    String view = {};
+    view.data = source_code->data + begin;
+    view.length = (c ? c - data : source_code->length) - begin;
+
+    MaskPass mask;
+    const char *terminators;
+    if(!GetFusedMask(options, &mask, &terminators))
+    {
+        mask.mask = CopyPass;
+    }
+
+    LatencyBudget *budget = state->budget;
+    state->budget = NULL;
+    ParseFused(&mask, NULL, state, GetStringWindow, &view, view.length);
+    state->budget = budget;
+
+    for(int i = 0; i < state->result.len; ++i)
+    {
+        state->result.open[i] += (uint32_t)begin;
+        state->result.close[i] += (uint32_t)begin;
+    }
+    for(int i = 1; i < state->line_starts.len; ++i)
+    {
+        Insert(&line_starts, state->line_starts.array[i] + (uint32_t)begin);
+    }
+    state->line_starts = line_starts;
+}
+
+// NOTE old is the state of the previous run on the same buffer and edit what changed since
+// then, both are NULL for a full parse
+void ParseSource(String *source_code, RainbowOptions *options, ParseState *state,
+                 ParseState *old = NULL, ParseEdit *edit = NULL)
+{
+    RunStats *stats = state->stats;
+    int num_allocations = state->arena.num_allocations;
+
+    ResetParseState(state);
+
+    // NOTE the pairs are stored with 32 bit offsets, larger buffers are not highlighted
+    if(source_code->length > UINT32_MAX || IsSuperseded(state->job))
+    {
+        return;
+    }
+
+    if(state->budget)
+    {
+        state->budget->parse_start = GetNanoseconds();
+        state->budget->start_done = 0;
+    }
+
+    ParseChunks chunks = {};
+    ParseChunks *parallel = NULL;
+    if(!old && SplitIntoChunks(source_code, options->num_threads, &chunks))
+    {
+        parallel = &chunks;
+    }
+
+    MaskPass fused;
+    const char *terminators;
+    if(!old && !parallel && !options->keep_masked && GetFusedMask(options, &fused, &terminators))
+    {
+        ParseFused(&fused, terminators, state, GetStringWindow, source_code, source_code->length);
+    }
+    else if(strcmp(options->filetype, "c") == 0)
+    {
+        ParseCFile(source_code, false, (options->check_pound_ifs == 'Y'), &options->defines, state, old, edit,
+                   parallel);
+    }
+    else if(strcmp(options->filetype, "cpp") == 0)
+    {
+        ParseCFile(source_code, (options->check_templates == 'Y'), (options->check_pound_ifs == 'Y'),
+                   &options->defines, state, old, edit, parallel);
+    }
+    else if(strcmp(options->filetype, "rust") == 0)
+    {
+        ParseRustFile(source_code, (options->check_templates == 'Y'), state, old, edit, parallel);
+    }
+    else if(Language *language = FindLanguage(options->languages, options->filetype))
+    {
+        ParseLanguageFile(source_code, language, (options->check_templates == 'Y'), state, old, edit, parallel);
+    }
+    else if(parallel)
+    {
+        uint64_t start = StartPhase(stats);
+        state->result = ParseGenericFileParallel(source_code->data, source_code->length, &state->arena,
+                                                 &state->line_starts, {}, {}, parallel, &state->bracket_checkpoints);
+        FinishPhase(stats, PHASE_BRACKETS, start, source_code->length);
+    }
+    else
+    {
+        if(!old)
+        {
+            edit = NULL;
+        }
+
+        uint64_t start = StartPhase(stats);
+        IncrementalRun run;
+        StartRun(&run, &state->bracket_checkpoints, old ? &old->bracket_checkpoints : NULL,
+                 edit, edit ? edit->start_pos.a : 0, edit ? edit->new_end + 1 : 0);
+        state->result = ParseGenericFile(source_code->data, source_code->length, &state->arena, &state->line_starts,
+                                         {}, {}, &run, old ? &old->result : NULL, old ? &old->line_starts : NULL);
+        FinishPhase(stats, PHASE_BRACKETS, start, &run, source_code->length);
+    }
+
+    state->fallback = state->budget ? state->budget->level : BUDGET_EXACT;
+    state->fallback_ms = state->budget ? state->budget->ms : 0;
+    if(state->fallback >= BUDGET_VIEWPORT && !IsSuperseded(state->job))
+    {
+        ParseViewport(source_code, options, state);
+    }
+
+    if(stats)
+    {
+        CollectStats(stats, state, source_code->length, parallel ? parallel->count : 0);
+        stats->allocations += state->arena.num_allocations - num_allocations;
+    }
+
+    Free(&chunks);
+}
+
+// NOTE a full parse of the input as it is read, a stream is never kept for a next run
+void ParseStream(SourceStream *stream, RainbowOptions *options, ParseState *state)
+{
+    RunStats *stats = state->stats;
+    int num_allocations = state->arena.num_allocations;
+
+    ResetParseState(state);
+
+    MaskPass mask;
+    const char *terminators;
+    if(!GetFusedMask(options, &mask, &terminators))
+    {
+        mask.mask = CopyPass;
+    }
+    ParseFused(&mask, terminators, state, GetStreamWindow, stream, 0);
+    state->fallback = state->budget ? state->budget->level : BUDGET_EXACT;
+    state->fallback_ms = state->budget ? state->budget->ms : 0;
+
+    if(stats)
+    {
+        CollectStats(stats, state, 0, 0);
+        stats->allocations += state->arena.num_allocations - num_allocations;
+    }
+}
+
+IntPair AdvancePosition(const char *c, size_t length, IntPair pos)
+{
+    for(const char *end = c + length; c < end; c++)
+    {
+        if(*c == '\n')
+        {
+            pos.a++;
+            pos.b = 1;
+        }
+        else
+        {
+            pos.b++;
+        }
+    }
+
+    return pos;
+}
+
+// NOTE finds the changed part by skipping the common prefix and suffix, the positions are
+// counted from the last checkpoint before the change
+void ComputeEdit(String *old_source, String *source_code, CheckpointVector *checkpoints, ParseEdit *edit)
+{
+    const char *a = old_source->data;
+    const char *b = source_code->data;
+    size_t length = old_source->length < source_code->length ? old_source->length : source_code->length;
+
+    size_t start = 0;
+    while(start + 4096 <= length && memcmp(a + start, b + start, 4096) == 0)
+    {
+        start += 4096;
+    }
+    while(start < length && a[start] == b[start])
+    {
+        start++;
+    }
+
+    size_t suffix = 0;
+    size_t max_suffix = length - start;
+    const char *a_end = a + old_source->length;
+    const char *b_end = b + source_code->length;
+    while(suffix + 4096 <= max_suffix && memcmp(a_end - suffix - 4096, b_end - suffix - 4096, 4096) == 0)
+    {
+        suffix += 4096;
+    }
+    while(suffix < max_suffix && a_end[-(long)suffix - 1] == b_end[-(long)suffix - 1])
+    {
+        suffix++;
+    }
+
+    edit->start = start;
+    edit->old_end = old_source->length - suffix;
+    edit->new_end = source_code->length - suffix;
+
+    IntPair pos = { 1, 1 };
+    size_t offset = 0;
+    for(int i = 0; i < checkpoints->len && checkpoints->array[i].offset <= start; ++i)
+    {
+        pos.a = checkpoints->array[i].line;
+        offset = checkpoints->array[i].offset;
+    }
+
+    edit->start_pos = AdvancePosition(a + offset, start - offset, pos);
+    edit->old_end_pos = AdvancePosition(a + start, edit->old_end - start, edit->start_pos);
+    edit->new_end_pos = AdvancePosition(b + start, edit->new_end - start, edit->start_pos);
+}
+
+bool ReadAll(int fd, void *data, size_t size)
+{
+    char *c = (char *)data;
+    while(size > 0)
+    {
+        ssize_t bytes_read = read(fd, c, size);
+        if(bytes_read <= 0)
+        {
+            return false;
+        }
+        c += bytes_read;
+        size -= bytes_read;
+    }
+    return true;
+}
+
+bool WriteAll(int fd, const void *data, size_t size)
+{
+    const char *c = (const char *)data;
+    while(size > 0)
+    {
+        ssize_t bytes_written = write(fd, c, size);
+        if(bytes_written <= 0)
+        {
+            return false;
+        }
+        c += bytes_written;
+        size -= bytes_written;
+    }
+    return true;
+}
+
+bool SetSocketAddress(sockaddr_un *address, const char *socket_path)
+{
+    if(strlen(socket_path) >= sizeof(address->sun_path))
+    {
+        return false;
+    }
+
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, socket_path);
+
+    return true;
+}
+
+// NOTE with a timeout the connect, every write and every read fail after timeout_ms instead
+// of waiting on a server that is busy
+int ConnectToServer(const char *socket_path, uint32_t timeout_ms = 0)
+{
+    sockaddr_un address;
+    if(!SetSocketAddress(&address, socket_path))
+    {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        return -1;
+    }
+
+    if(timeout_ms)
+    {
+        timeval timeout;
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_usec = (timeout_ms % 1000) * 1000;
+        if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0 ||
+           setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if(connect(fd, (sockaddr *)&address, sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// NOTE the rainbower server is only trusted in a private directory, see IsPrivateSocketDirectory
+int ConnectToRainbower(const char *socket_path, uint32_t timeout_ms = 0)
+{
+    return IsPrivateSocketDirectory(socket_path) ? ConnectToServer(socket_path, timeout_ms) : -1;
+}
+
+// NOTE: kakoune's remote messages are the type as a byte and the size of the whole message as
+// 32 bits, then the fields, a command is one string written as its 32 bit length and its bytes,
+// the same message kak -p sends
+#define KAKOUNE_MESSAGE_COMMAND 2
+
+// NOTE the socket kakoune creates for the session, a name with a / is the path of the socket
+bool GetSessionSocketPath(char *path, size_t size, const char *session)
+{
+    int length;
+    const char *runtime_directory = getenv("XDG_RUNTIME_DIR");
+    if(strchr(session, '/'))
+    {
+        length = snprintf(path, size, "%s", session);
+    }
+    else if(runtime_directory && *runtime_directory)
+    {
+        length = snprintf(path, size, "%s/kakoune/%s", runtime_directory, session);
+    }
+    else
+    {
+        const char *temporary_directory = getenv("TMPDIR");
+        passwd *user = getpwuid(geteuid());
+        length = snprintf(path, size, "%s/kakoune-%s/%s",
+                          (temporary_directory && *temporary_directory) ? temporary_directory : "/tmp",
+                          user ? user->pw_name : "", session);
+    }
+
+    return length > 0 && (size_t)length < size;
+}
+
+bool SendToSession(const char *session, const char *command, size_t length)
+{
+    char path[4096];
+    if(length > UINT32_MAX - 9 || !GetSessionSocketPath(path, sizeof(path), session))
+    {
+        return false;
+    }
+
+    int fd = ConnectToServer(path);
+    if(fd < 0)
+    {
+        return false;
+    }
+
+    char header[9];
+    uint32_t message_size = (uint32_t)(sizeof(header) + length);
+    uint32_t command_length = (uint32_t)length;
+    header[0] = KAKOUNE_MESSAGE_COMMAND;
+    memcpy(header + 1, &message_size, sizeof(message_size));
+    memcpy(header + 5, &command_length, sizeof(command_length));
+
+    bool ok = WriteAll(fd, header, sizeof(header)) && WriteAll(fd, command, length);
+    close(fd);
+
+    return ok;
+}
+
+// NOTE with a session the commands go straight to kakoune instead of through kak -p, they are
+// printed when its socket can't be used
+void WriteOutput(const char *session, const char *data, size_t length)
+{
+    if(length > 0 && (!session || !SendToSession(session, data, length)))
+    {
+        WriteAll(STDOUT_FILENO, data, length);
+    }
+}
+
+// NOTE the whole output is built in memory and written with a single write
+struct OutputBuffer
+{
+    char *data;
+    size_t length;
+    size_t size;
+};
+
+void Reserve(OutputBuffer *out, size_t size)
+{
+    if(size > out->size)
+    {
+        size_t new_size = out->size ? out->size * 2 : 4096;
+        while(new_size < size)
+        {
+            new_size *= 2;
+        }
+        out->data = (char *)realloc(out->data, new_size);
+        out->size = new_size;
+    }
+}
+
+void Free(OutputBuffer *out)
+{
+    free(out->data);
+    *out = {};
+}
+
+void Append(OutputBuffer *out, const char *data, size_t length)
+{
+    Reserve(out, out->length + length);
+    memcpy(out->data + out->length, data, length);
+    out->length += length;
+}
+
+void Append(OutputBuffer *out, const char *string)
+{
+    Append(out, string, strlen(string));
+}
+
+const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// NOTE same as %d, two digits at a time from the end, returns where the number ends
+char *WriteInt(char *c, int value)
+{
+    char digits[16];
+    char *end = digits + sizeof(digits);
+    char *d = end;
+
+    unsigned int n = (value < 0) ? 0u - (unsigned int)value : (unsigned int)value;
+    while(n >= 100)
+    {
+        unsigned int pair = (n % 100) * 2;
+        n /= 100;
+        *--d = digit_pairs[pair + 1];
+        *--d = digit_pairs[pair];
+    }
+    if(n >= 10)
+    {
+        *--d = digit_pairs[n * 2 + 1];
+        *--d = digit_pairs[n * 2];
+    }
+    else
+    {
+        *--d = '0' + n;
+    }
+    if(value < 0)
+    {
+        *--d = '-';
+    }
+
+    memcpy(c, d, end - d);
+    return c + (end - d);
+}
+
+struct OutputFragment
+{
+    const char *data;
+    size_t length;
+};
+
+// NOTE writes "a.b,c.d" followed by the color fragment
+void AppendRange(OutputBuffer *out, IntPair from, IntPair to, OutputFragment fragment)
+{
+    // NOTE an int is at most 11 characters
+    Reserve(out, out->length + 4 * 11 + 3 + fragment.length);
+
+    char *c = out->data + out->length;
+    c = WriteInt(c, from.a);
+    *c++ = '.';
+    c = WriteInt(c, from.b);
+    *c++ = ',';
+    c = WriteInt(c, to.a);
+    *c++ = '.';
+    c = WriteInt(c, to.b);
+    memcpy(c, fragment.data, fragment.length);
+    c += fragment.length;
+
+    out->length = c - out->data;
+}
+
+// NOTE builds "prefix color " for every color in one block
+OutputFragment *MakeColorFragments(const char *prefix, const char **colors, int num_colors)
+{
+    size_t prefix_length = strlen(prefix);
+    size_t total = 0;
+    for(int i = 0; i < num_colors; ++i)
+    {
+        total += prefix_length + strlen(colors[i]) + 1;
+    }
+
+    OutputFragment *fragments = (OutputFragment *)malloc(num_colors * sizeof(OutputFragment) + total + 1);
+    char *c = (char *)(fragments + num_colors);
+    for(int i = 0; i < num_colors; ++i)
+    {
+        size_t length = strlen(colors[i]);
+        fragments[i].data = c;
+        fragments[i].length = prefix_length + length + 1;
+        memcpy(c, prefix, prefix_length);
+        memcpy(c + prefix_length, colors[i], length);
+        c[prefix_length + length] = ' ';
+        c += fragments[i].length;
+    }
+
+    return fragments;
+}
+
+// NOTE the window in offsets, the _end ones are the first offsets after the position
+struct WindowOffsets
+{
+    uint32_t top;
+    uint32_t top_end;
+    uint32_t bottom;
+    uint32_t bottom_end;
+};
+
+WindowOffsets GetWindowOffsets(ParseState *state, IntPair top, IntPair bottom)
+{
+    WindowOffsets window;
+    window.top = GetOffset(state, top);
+    window.top_end = GetOffset(state, {top.a, top.b + 1});
+    window.bottom = GetOffset(state, bottom);
+    window.bottom_end = GetOffset(state, {bottom.a, bottom.b + 1});
+    return window;
+}
+
+bool IsVisible(WindowOffsets *window, uint32_t offset)
+{
+    return (offset >= window->top && offset < window->bottom_end);
+}
+
+bool IsRangeVisible(WindowOffsets *window, uint32_t open, uint32_t close)
+{
+    return (IsVisible(window, open) || IsVisible(window, close) ||
+            (open < window->top_end && close >= window->bottom));
+}
+
+// NOTE a background segment waiting to be printed, it grows while the next one has the same color
+struct BackgroundSegment
+{
+    uint32_t begin;
+    uint32_t end;
+    int color;
+};
+
+void PrintBackgroundSegment(OutputBuffer *out, ParseState *state, BackgroundSegment *segment, OutputFragment *colors)
+{
+    if(segment->begin < segment->end)
+    {
+        AppendRange(out, GetPosition(state, segment->begin), GetPosition(state, segment->end - 1),
+                    colors[segment->color]);
+    }
+}
+
+void AddBackgroundSegment(OutputBuffer *out, ParseState *state, BackgroundSegment *segment,
+                          OutputFragment *colors, uint32_t begin, uint32_t end, int color)
+{
+    if(begin >= end)
+    {
+        return;
+    }
+    if(segment->end == begin && segment->color == color)
+    {
+        segment->end = end;
+        return;
+    }
+
+    PrintBackgroundSegment(out, state, segment, colors);
+    *segment = {begin, end, color};
+}
+
+// NOTE the nested scopes would each cover the whole window with their background, instead the
+// pairs are swept in opening order with the ones still open on a stack and every part of the
+// window gets the background of the innermost one, as the last range printed would give it.
+// The pairs with no pairs inside are most of them, they don't split the segment of the pair
+// around them but are printed on top of it at the end, so a scope full of calls is still one
+// range and nothing is painted more than twice
+void PrintBackgrounds(OutputBuffer *out, ParseState *state, PairIndex *index, WindowOffsets *window,
+                      OutputFragment *colors, int num_colors)
+{
+    PairVector *result = &state->result;
+    int *stack = (int *)malloc((index->len + 1) * sizeof(int));
+    int stack_len = 0;
+    int *leaves = (int *)malloc((index->len + 1) * sizeof(int));
+    int num_leaves = 0;
+
+    // NOTE the pairs around the top of the window, from the outermost one
+    int first = FindFirstOpen(index, result, window->top);
+    for(int n = FindEnclosingPair(index, result, first, window->top); n >= 0; n = index->parent[n])
+    {
+        stack[stack_len++] = n;
+    }
+    for(int i = 0, j = stack_len - 1; i < j; ++i, --j)
+    {
+        int n = stack[i];
+        stack[i] = stack[j];
+        stack[j] = n;
+    }
+
+    BackgroundSegment segment = {};
+    uint32_t position = window->top;
+    for(int slot = first; slot <= index->len; ++slot)
+    {
+        uint32_t next = window->bottom_end;
+        if(slot < index->len && result->open[index->by_open[slot]] < window->bottom_end)
+        {
+            next = result->open[index->by_open[slot]];
+        }
+
+        // NOTE the pairs closed before the next one opens end their segment at their close
+        while(stack_len > 0)
+        {
+            int n = stack[stack_len - 1];
+            int color = result->level[n] % num_colors;
+            if(result->close[n] >= next)
+            {
+                AddBackgroundSegment(out, state, &segment, colors, position, next, color);
+                break;
+            }
+            AddBackgroundSegment(out, state, &segment, colors, position, result->close[n] + 1, color);
+            position = result->close[n] + 1;
+            stack_len--;
+        }
+        position = next;
+
+        if(next == window->bottom_end)
+        {
+            break;
+        }
+
+        int n = index->by_open[slot];
+        if(slot + 1 == index->len || result->open[index->by_open[slot + 1]] > result->close[n])
+        {
+            leaves[num_leaves++] = n;
+        }
+        else
+        {
+            stack[stack_len++] = n;
+        }
+    }
+    PrintBackgroundSegment(out, state, &segment, colors);
+
+    for(int i = 0; i < num_leaves; ++i)
+    {
+        int n = leaves[i];
+        BackgroundSegment leaf = {result->open[n], result->close[n] + 1, result->level[n] % num_colors};
+        if(leaf.end > window->bottom_end)
+        {
+            leaf.end = window->bottom_end;
+        }
+        PrintBackgroundSegment(out, state, &leaf, colors);
+    }
+
+    free(leaves);
+    free(stack);
+}
+
+// NOTE the window and the cursor are turned into offsets once, only the pairs the index finds
+// around the window are looked at and only the printed ones get their lines and columns, the
+// cursor scope is the innermost pair around the cursor
+void PrintRanges(OutputBuffer *out, RainbowOptions *options, ParseState *state)
+{
+    IntPair cursor_pair = options->cursor_pair;
+    WindowOffsets window = GetWindowOffsets(state, options->window_top, options->window_bottom);
+
+    PairVector *result = &state->result;
+    PairIndex *index = GetPairIndex(state);
+    int *pairs = (int *)malloc((index->len + 1) * sizeof(int));
+    int num_pairs = FindVisiblePairs(index, result, window.top, window.bottom_end, pairs);
+
+    OutputFragment *colors = MakeColorFragments("|", options->colors, options->num_colors);
+    OutputFragment *background_colors = MakeColorFragments("|default,", options->background_colors,
+                                                           options->num_background_colors);
+
+    Append(out, "evaluate-commands -buffer ");
+    Append(out, options->buffile);
+    Append(out, " -- set-option buffer rainbow ");
+    Append(out, options->timestamp);
+    Append(out, " ");
+
+    for(int i = 0; i < num_pairs; ++i)
+    {
+        int n = pairs[i];
+        uint32_t open = result->open[n];
+        uint32_t close = result->close[n];
+        OutputFragment color = colors[result->level[n] % (options->num_colors)];
+        if(IsVisible(&window, open))
+        {
+            IntPair pair = GetPosition(state, open);
+            AppendRange(out, pair, pair, color);
+        }
+        if(IsVisible(&window, close))
+        {
+            IntPair pair = GetPosition(state, close);
+            AppendRange(out, pair, pair, color);
+        }
+    }
+
+    // NOTE with a latency budget the level it ended at is set in rainbow_budget_level, the
+    // backgrounds are left out when it's short or the parse already fell back
+    int fallback = state->fallback;
+    if(options->mode == '2' && fallback == BUDGET_EXACT && IsBudgetShort(state->budget))
+    {
+        fallback = BUDGET_NO_BACKGROUNDS;
+    }
+
+    if(options->mode == '2' && fallback == BUDGET_EXACT)
+    {
+        PrintBackgrounds(out, state, index, &window, background_colors, options->num_background_colors);
+    }
+
+    if(options->mode == '1')
+    {
+        // NOTE the pairs opened at or before the cursor and closed at or after it
+        uint32_t cursor = GetOffset(state, cursor_pair);
+        uint32_t cursor_end = GetOffset(state, {cursor_pair.a, cursor_pair.b + 1});
+        int n = FindEnclosingPair(index, result, FindFirstOpen(index, result, cursor_end), cursor);
+        if(n >= 0)
+        {
+            uint32_t open = result->open[n];
+            uint32_t close = result->close[n];
+            OutputFragment color = {"|default,rgb:181818 ", 20};
+            if(IsRangeVisible(&window, open, close))
+            {
+                AppendRange(out, GetPosition(state, open), GetPosition(state, close), color);
+            }
+        }
+    }
+
+    if(state->budget)
+    {
+        char line[64];
+        snprintf(line, sizeof(line), " -- set-option buffer rainbow_budget_level %d", fallback);
+        Append(out, "\nevaluate-commands -buffer ");
+        Append(out, options->buffile);
+        Append(out, line);
+    }
+
+    free(pairs);
+    free(colors);
+    free(background_colors);
+}
+
+// NOTE the stats are sent to the *debug* buffer, quotes in the buffile are doubled for kakoune
+void PrintStats(OutputBuffer *out, RainbowOptions *options, RunStats *stats)
+{
+    Append(out, "\necho -debug 'rainbower ");
+    for(const char *c = options->buffile; *c; ++c)
+    {
+        Append(out, c, 1);
+        if(*c == '\'')
+        {
+            Append(out, c, 1);
+        }
+    }
+
+    char line[512];
+    snprintf(line, sizeof(line), " %s:", options->timestamp);
+    Append(out, line);
+    for(int phase = 0; phase < NUM_PHASES; ++phase)
+    {
+        if(stats->phase_ran[phase])
+        {
+            snprintf(line, sizeof(line), " %s %.3fms %zuB", phase_names[phase], stats->phase_ns[phase] / 1e6,
+                     stats->phase_bytes[phase]);
+            Append(out, line);
+        }
+    }
+    snprintf(line, sizeof(line), ", %d pairs, depth %d", stats->num_pairs, stats->max_depth);
+    Append(out, line);
+    // NOTE a pair file has no masked buffer and no #if blocks to count them from
+    if(stats->cache_hit)
+    {
+        Append(out, ", n/a template candidates n/a rejected, n/a hidden #if blocks");
+    }
+    else
+    {
+        snprintf(line, sizeof(line), ", %d template candidates %d rejected, %d hidden #if blocks",
+                 stats->template_candidates, stats->templates_rejected, stats->hidden_blocks);
+        Append(out, line);
+    }
+    snprintf(line, sizeof(line), ", %d allocations", stats->allocations);
+    Append(out, line);
+    if(stats->num_chunks > 0)
+    {
+        snprintf(line, sizeof(line), ", %d parallel chunks", stats->num_chunks);
+        Append(out, line);
+    }
+    if(stats->cache_hit)
+    {
+        Append(out, ", from the cache");
+    }
+    if(stats->fallback > BUDGET_EXACT)
+    {
+        snprintf(line, sizeof(line), ", over the latency budget: %s", budget_level_names[stats->fallback]);
+        Append(out, line);
+    }
+    Append(out, "'\n");
+}
+
+// NOTE: the full parses of large buffers are kept in a cache directory shared by all the
+// sessions, the file of a parse is named after the hash of the buffer and of everything else
+// the parse depends on, so reopening an unchanged file only reads its pairs back. A file is
+// written next to its name and renamed over it, so the others see all of it or nothing, and
+// a hit touches it, the least recently used ones go when the directory grows too large
+#define CACHE_VERSION 1
+#define CACHE_MIN_LENGTH (1024 * 1024)
+#define CACHE_MAX_SIZE ((uint64_t)256 * 1024 * 1024)
+#define CACHE_SUFFIX ".rbpc"
+
+#define HASH_PRIME_1 11400714785074694791ull
+#define HASH_PRIME_2 14029467366897019727ull
+#define HASH_PRIME_3 1609587929392839161ull
+#define HASH_PRIME_4 9650029242287828579ull
+#define HASH_PRIME_5 2870177450012600261ull
+
+uint64_t RotateLeft(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t HashRound(uint64_t lane, uint64_t input)
+{
+    return RotateLeft(lane + input * HASH_PRIME_2, 31) * HASH_PRIME_1;
+}
+
+// NOTE xxHash64, the four lanes of a 32 byte stripe don't depend on each other so they go in
+// parallel, it hashes several GB/s which is a lot faster than the parse it saves
+uint64_t HashBuffer(const void *data, size_t length, uint64_t seed)
+{
+    const char *c = (const char *)data;
+    const char *end = c + length;
+
+    uint64_t hash;
+    if(length >= 32)
+    {
+        uint64_t lanes[4] = {seed + HASH_PRIME_1 + HASH_PRIME_2, seed + HASH_PRIME_2, seed, seed - HASH_PRIME_1};
+        for(; end - c >= 32; c += 32)
+        {
+            for(int i = 0; i < 4; ++i)
+            {
+                uint64_t input;
+                memcpy(&input, c + 8 * i, sizeof(input));
+                lanes[i] = HashRound(lanes[i], input);
+            }
+        }
+
+        hash = RotateLeft(lanes[0], 1) + RotateLeft(lanes[1], 7) + RotateLeft(lanes[2], 12) + RotateLeft(lanes[3], 18);
+        for(int i = 0; i < 4; ++i)
+        {
+            hash = (hash ^ HashRound(0, lanes[i])) * HASH_PRIME_1 + HASH_PRIME_4;
+        }
+    }
+    else
+    {
+        hash = seed + HASH_PRIME_5;
+    }
+    hash += length;
+
+    for(; end - c >= 8; c += 8)
+    {
+        uint64_t input;
+        memcpy(&input, c, sizeof(input));
+        hash = RotateLeft(hash ^ HashRound(0, input), 27) * HASH_PRIME_1 + HASH_PRIME_4;
+    }
+    if(end - c >= 4)
+    {
+        uint32_t input;
+        memcpy(&input, c, sizeof(input));
+        hash = RotateLeft(hash ^ (input * HASH_PRIME_1), 23) * HASH_PRIME_2 + HASH_PRIME_3;
+        c += 4;
+    }
+    for(; c < end; ++c)
+    {
+        hash = RotateLeft(hash ^ ((uint8_t)*c * HASH_PRIME_5), 11) * HASH_PRIME_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME_2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME_3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+// NOTE the filetype, the flags and the defines, and for a language of the languages file its
+// constructs, so editing the file doesn't bring back parses of the old ones
+uint64_t GetCacheKey(String *source_code, RainbowOptions *options)
+{
+    uint64_t key = HashBuffer(source_code->data, source_code->length, CACHE_VERSION);
+    key = HashBuffer(options->filetype, strlen(options->filetype) + 1, key);
+    char flags[2] = {options->check_templates, options->check_pound_ifs};
+    key = HashBuffer(flags, sizeof(flags), key);
+    for(int i = 0; i < options->defines.count; ++i)
+    {
+        key = HashBuffer(options->defines.names[i], strlen(options->defines.names[i]) + 1, key);
+    }
+
+    if(Language *language = FindLanguage(options->languages, options->filetype))
+    {
+        for(int i = 0; i < language->num_constructs; ++i)
+        {
+            LexerConstruct *construct = &language->constructs[i];
+            char kind = (char)construct->kind;
+            key = HashBuffer(&kind, 1, key);
+            key = HashBuffer(construct->open, strlen(construct->open) + 1, key);
+            key = HashBuffer(construct->close, strlen(construct->close) + 1, key);
+            key = HashBuffer(&construct->escape, 1, key);
+        }
+        key = HashBuffer(language->generic_terminators, strlen(language->generic_terminators) + 1, key);
+    }
+
+    return key;
+}
+
+// NOTE makes the directories of the path that are missing, the parents too, like mkdir -p
+bool MakeDirectories(char *path, mode_t mode)
+{
+    for(char *c = path + 1; *c; ++c)
+    {
+        if(*c == '/')
+        {
+            *c = 0;
+            mkdir(path, mode);
+            *c = '/';
+        }
+    }
+    mkdir(path, mode);
+
+    struct stat directory_info;
+    return stat(path, &directory_info) == 0 && S_ISDIR(directory_info.st_mode);
+}
+
+// NOTE $XDG_CACHE_HOME/rainbower or ~/.cache/rainbower, made when it's missing
+bool GetCacheDirectory(char *path, size_t size)
+{
+    int length;
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if(cache_home && *cache_home)
+    {
+        length = snprintf(path, size, "%s/rainbower", cache_home);
+    }
+    else if(home && *home)
+    {
+        length = snprintf(path, size, "%s/.cache/rainbower", home);
+    }
+    else
+    {
+        return false;
+    }
+    if(length <= 0 || (size_t)length >= size)
+    {
+        return false;
+    }
+
+    return MakeDirectories(path, 0700);
+}
+
+// NOTE the header of a pair file, then the open offsets, the close offsets and the levels of
+// the pairs, 10 bytes a pair, and the line starts, reading them back is several times faster
+// than finding the newlines again
+struct CacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint64_t length;
+    uint32_t num_pairs;
+    uint32_t num_line_starts;
+};
+
+bool LoadCachedParse(const char *path, uint64_t key, String *source_code, ParseState *state)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return false;
+    }
+
+    CacheHeader header;
+    struct stat file_info;
+    bool ok = (fstat(fd, &file_info) == 0 && ReadAll(fd, &header, sizeof(header)) &&
+               memcmp(header.magic, "RBPC", 4) == 0 && header.version == CACHE_VERSION && header.key == key &&
+               header.length == source_code->length && header.num_pairs <= INT32_MAX &&
+               header.num_line_starts <= INT32_MAX &&
+               (uint64_t)file_info.st_size == sizeof(header) + (uint64_t)header.num_pairs * 10 +
+                                              (uint64_t)header.num_line_starts * 4);
+    if(ok)
+    {
+        ResetParseState(state);
+        int num_pairs = (int)header.num_pairs;
+        state->result = MakePairVector(&state->arena, num_pairs);
+        int num_line_starts = (int)header.num_line_starts;
+        state->line_starts = MakeOffsetVector(&state->arena, num_line_starts);
+        ok = (ReadAll(fd, state->result.open, sizeof(uint32_t) * num_pairs) &&
+              ReadAll(fd, state->result.close, sizeof(uint32_t) * num_pairs) &&
+              ReadAll(fd, state->result.level, sizeof(uint16_t) * num_pairs) &&
+              ReadAll(fd, state->line_starts.array, sizeof(uint32_t) * num_line_starts));
+        state->result.len = num_pairs;
+        state->line_starts.len = num_line_starts;
+        futimens(fd, NULL);
+    }
+    close(fd);
+
+    if(!ok)
+    {
+        ResetParseState(state);
+        return false;
+    }
+
+    return true;
+}
+
+struct CacheEntry
+{
+    char name[32];
+    time_t used;
+    off_t size;
+};
+
+int CompareCacheEntries(const void *a, const void *b)
+{
+    time_t used_a = ((const CacheEntry *)a)->used;
+    time_t used_b = ((const CacheEntry *)b)->used;
+    return (used_a > used_b) - (used_a < used_b);
+}
+
+// NOTE when the pair files take more than CACHE_MAX_SIZE the least recently used ones are
+// removed until they take three quarters of it, with the temporary files of crashed runs
+void EvictCache(const char *directory)
+{
+    DIR *dir = opendir(directory);
+    if(!dir)
+    {
+        return;
+    }
+
+    CacheEntry *entries = NULL;
+    int num_entries = 0;
+    int size = 0;
+    uint64_t total_size = 0;
+    time_t now = time(NULL);
+    while(dirent *entry = readdir(dir))
+    {
+        struct stat file_info;
+        size_t name_length = strlen(entry->d_name);
+        if(name_length >= sizeof(CacheEntry::name) || fstatat(dirfd(dir), entry->d_name, &file_info, 0) != 0 ||
+           !S_ISREG(file_info.st_mode))
+        {
+            continue;
+        }
+
+        if(entry->d_name[0] == '.' && now - file_info.st_mtime > 3600)
+        {
+            unlinkat(dirfd(dir), entry->d_name, 0);
+        }
+        else if(name_length > strlen(CACHE_SUFFIX) &&
+                strcmp(entry->d_name + name_length - strlen(CACHE_SUFFIX), CACHE_SUFFIX) == 0)
+        {
+            if(num_entries == size)
+            {
+                size = size ? size * 2 : 64;
+                CacheEntry *grown = (CacheEntry *)realloc(entries, sizeof(CacheEntry) * size);
+                if(!grown)
+                {
+                    break;
+                }
+                entries = grown;
+            }
+            CacheEntry *cache_entry = &entries[num_entries++];
+            memcpy(cache_entry->name, entry->d_name, name_length + 1);
+            cache_entry->used = file_info.st_mtime;
+            cache_entry->size = file_info.st_size;
+            total_size += file_info.st_size;
+        }
+    }
+
+    if(total_size > CACHE_MAX_SIZE)
+    {
+        qsort(entries, num_entries, sizeof(CacheEntry), CompareCacheEntries);
+        for(int i = 0; i < num_entries && total_size > CACHE_MAX_SIZE / 4 * 3; ++i)
+        {
+            if(unlinkat(dirfd(dir), entries[i].name, 0) == 0)
+            {
+                total_size -= entries[i].size;
+            }
+        }
+    }
+
+    free(entries);
+    closedir(dir);
+}
+
+void SaveCachedParse(const char *directory, const char *path, uint64_t key, String *source_code,
+                     ParseState *state)
+{
+    char temporary_path[4096];
+    if(snprintf(temporary_path, sizeof(temporary_path), "%s/.XXXXXX", directory) >= (int)sizeof(temporary_path))
+    {
+        return;
+    }
+    int fd = mkstemp(temporary_path);
+    if(fd < 0)
+    {
+        return;
+    }
+
+    CacheHeader header = {};
+    memcpy(header.magic, "RBPC", 4);
+    header.version = CACHE_VERSION;
+    header.key = key;
+    header.length = source_code->length;
+    header.num_pairs = state->result.len;
+    header.num_line_starts = state->line_starts.len;
+
+    PairVector *result = &state->result;
+    bool ok = (WriteAll(fd, &header, sizeof(header)) &&
+               WriteAll(fd, result->open, sizeof(uint32_t) * result->len) &&
+               WriteAll(fd, result->close, sizeof(uint32_t) * result->len) &&
+               WriteAll(fd, result->level, sizeof(uint16_t) * result->len) &&
+               WriteAll(fd, state->line_starts.array, sizeof(uint32_t) * state->line_starts.len));
+    ok = (close(fd) == 0) && ok;
+
+    if(ok && rename(temporary_path, path) == 0)
+    {
+        EvictCache(directory);
+    }
+    else
+    {
+        unlink(temporary_path);
+    }
+}
+
+// NOTE a full parse of a large buffer goes through the cache, only a parse that is exact is
+// saved, a hit has no checkpoints so the next run on the buffer parses all of it
+void ParseCached(String *source_code, RainbowOptions *options, ParseState *state)
+{
+    char directory[4000];
+    if(source_code->length < CACHE_MIN_LENGTH || source_code->length > UINT32_MAX ||
+       !GetCacheDirectory(directory, sizeof(directory)))
+    {
+        ParseSource(source_code, options, state);
+        return;
+    }
+
+    RunStats *stats = state->stats;
+    uint64_t start = StartPhase(stats);
+    uint64_t key = GetCacheKey(source_code, options);
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%016llx" CACHE_SUFFIX, directory, (unsigned long long)key);
+    if(LoadCachedParse(path, key, source_code, state))
+    {
+        FinishPhase(stats, PHASE_CACHE, start, source_code->length);
+        if(stats)
+        {
+            CollectStats(stats, state, source_code->length, 0);
+            stats->cache_hit = true;
+        }
+        return;
+    }
+    FinishPhase(stats, PHASE_CACHE, start, source_code->length);
+
+    ParseSource(source_code, options, state);
+
+    if(state->fallback == BUDGET_EXACT && !IsSuperseded(state->job) && state->line_starts.len > 0)
+    {
+        start = StartPhase(stats);
+        SaveCachedParse(directory, path, key, source_code, state);
+        FinishPhase(stats, PHASE_CACHE, start, 0);
+    }
+}
+
+// NOTE job is the slot of a run started from kakoune, a superseded run prints nothing, with a
+// session the output is sent to kakoune
+// NOTE with a stream the buffer is parsed as it is read and source_code is left empty
+int RunOnce(int argc, const char **argv, String *source_code, RunStats *stats = NULL, JobSlot *job = NULL,
+            const char *session = NULL, SourceStream *stream = NULL, LatencyBudget *budget = NULL)
+{
+    RainbowOptions options;
+    if(!ParseOptions(argc, argv, &options) || (!source_code->data && !stream))
+    {
+        return -1;
+    }
+    options.num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    // NOTE c, cpp and rust have their own parsers, the others can be in the languages file
+    if(!HasOwnParser(options.filetype))
+    {
+        char *languages_path = FindLanguagesFile();
+        options.languages = LoadLanguages(languages_path, options.filetype);
+        free(languages_path);
+    }
+
+    ParseState state = {};
+    state.stats = stats;
+    state.job = job;
+    state.budget = budget;
+    if(stream)
+    {
+        ParseStream(stream, &options, &state);
+    }
+    else
+    {
+        ParseCached(source_code, &options, &state);
+    }
+
+    OutputBuffer out = {};
+    if(!IsSuperseded(job))
+    {
+        uint64_t start = StartPhase(stats);
+        PrintRanges(&out, &options, &state);
+        FinishPhase(stats, PHASE_OUTPUT, start, out.length);
+        if(stats)
+        {
+            PrintStats(&out, &options, stats);
+        }
+    }
+    // NOTE checked again, a newer run can start while this one prints
+    if(!IsSuperseded(job))
+    {
+        WriteOutput(session, out.data, out.length);
+    }
+
+    Free(&out);
+    Free(&state);
+    Free(options.languages);
+
+    return 0;
+}
+
+// NOTE: batch mode parses whole trees of files, every worker has its own ParseState so the
+// arenas are never shared between threads, the files are dealt to the workers and the ones
+// that run out steal half of what another one has left
+struct FileTypeMapping
+{
+    const char *extension;
+    const char *filetype;
+};
+
+// NOTE the same filetypes kakoune gives these files, a .h is c unless -m h=cpp is given
+FileTypeMapping default_file_types[] =
+{
+    {"c", "c"}, {"h", "c"},
+    {"cc", "cpp"}, {"cpp", "cpp"}, {"cxx", "cpp"}, {"C", "cpp"},
+    {"hh", "cpp"}, {"hpp", "cpp"}, {"hxx", "cpp"}, {"H", "cpp"}, {"inl", "cpp"},
+    {"rs", "rust"},
+    {"py", "python"}, {"go", "go"}, {"js", "javascript"}, {"mjs", "javascript"}, {"ts", "typescript"},
+    {"java", "java"}, {"lua", "lua"}, {"kak", "kak"}, {"lisp", "lisp"}, {"el", "lisp"},
+    {"scm", "scheme"}, {"clj", "clojure"},
+};
+
+#define NUM_DEFAULT_FILE_TYPES (int)(sizeof(default_file_types) / sizeof(default_file_types[0]))
+
+struct BatchOptions
+{
+    const char *index_path;
+    int num_threads;
+
+    // NOTE the -m mappings come first so they override the default ones
+    FileTypeMapping *file_types;
+    int num_file_types;
+    const char *glob;
+
+    char check_templates;
+    char check_pound_ifs;
+    PoundIfDefines defines;
+    Language *languages;
+
+    const char **paths;
+    int num_paths;
+};
+
+struct BatchFile
+{
+    char *path;
+    const char *filetype;
+    size_t size;
+
+    // NOTE where the record of the file ended up in the output of its worker
+    int worker;
+    size_t record_offset;
+    size_t record_length;
+};
+
+struct BatchFileVector
+{
+    BatchFile *array;
+    int len;
+    int size;
+};
+
+void Insert(BatchFileVector *vector, BatchFile elem)
+{
+    if(vector->len == vector->size)
+    {
+        vector->size = vector->size ? vector->size * 2 : 256;
+        vector->array = (BatchFile *)realloc(vector->array, vector->size * sizeof(BatchFile));
+    }
+    vector->array[vector->len++] = elem;
+}
+
+void Free(BatchFileVector *vector)
+{
+    for(int i = 0; i < vector->len; ++i)
+    {
+        free(vector->array[i].path);
+    }
+    free(vector->array);
+    *vector = {};
+}
+
+// NOTE the filetype is looked up from the extension, files that are not in the map use the
+// generic parser, returns NULL when there is no extension mapped
+const char *FindFileType(BatchOptions *options, const char *path)
+{
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    const char *extension = strrchr(name, '.');
+    if(!extension || extension == name)
+    {
+        return NULL;
+    }
+    extension++;
+
+    for(int i = 0; i < options->num_file_types; ++i)
+    {
+        if(strcmp(options->file_types[i].extension, extension) == 0)
+        {
+            return options->file_types[i].filetype;
+        }
+    }
+
+    return NULL;
+}
+
+bool AddBatchFile(BatchFileVector *files, const char *path, const char *filetype, struct stat *file_info)
+{
+    // NOTE the index stores 32 bit offsets
+    if(!S_ISREG(file_info->st_mode) || (uint64_t)file_info->st_size >= UINT32_MAX)
+    {
+        return false;
+    }
+
+    BatchFile file = {};
+    file.path = CopyString(path);
+    file.filetype = filetype ? filetype : "none";
+    file.size = file_info->st_size;
+    Insert(files, file);
+
+    return true;
+}
+
+// NOTE hidden entries (.git and the like) are skipped and links to directories are not
+// followed, inside the directories a file is parsed when it matches the glob or, without
+// one, when its extension is in the map
+void CollectBatchFiles(BatchOptions *options, BatchFileVector *files, const char *path, bool top_level)
+{
+    struct stat file_info;
+    if((top_level ? stat(path, &file_info) : lstat(path, &file_info)) != 0)
+    {
+        fprintf(stderr, "rainbower: can't open %s\n", path);
+        return;
+    }
+
+    if(S_ISDIR(file_info.st_mode))
+    {
+        DIR *dir = opendir(path);
+        if(!dir)
+        {
+            fprintf(stderr, "rainbower: can't open %s\n", path);
+            return;
+        }
+
+        size_t path_length = strlen(path);
+        for(struct dirent *entry = readdir(dir); entry; entry = readdir(dir))
+        {
+            if(entry->d_name[0] == '.')
+            {
+                continue;
+            }
+
+            size_t name_length = strlen(entry->d_name);
+            char *child = (char *)malloc(path_length + name_length + 2);
+            memcpy(child, path, path_length);
+            child[path_length] = '/';
+            memcpy(child + path_length + 1, entry->d_name, name_length + 1);
+
+            CollectBatchFiles(options, files, child, false);
+
+            free(child);
+        }
+
+        closedir(dir);
+        return;
+    }
+
+    const char *filetype = FindFileType(options, path);
+    if(top_level)
+    {
+        AddBatchFile(files, path, filetype, &file_info);
+        return;
+    }
+
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    bool matches = options->glob ? (fnmatch(options->glob, name, 0) == 0) : (filetype != NULL);
+    if(matches)
+    {
+        // NOTE links to files are parsed as the file they point to
+        if(S_ISLNK(file_info.st_mode) && stat(path, &file_info) != 0)
+        {
+            return;
+        }
+        AddBatchFile(files, path, filetype, &file_info);
+    }
+}
+
+// NOTE the range of files [begin, end) left to a worker is packed in one word, so that taking
+// one from the front (the owner) and stealing the back half (the others) are a single CAS,
+// every queue gets its own cache line
+struct BatchQueue
+{
+    uint64_t range;
+    char padding[56];
+};
+
+uint64_t PackBatchRange(uint32_t begin, uint32_t end)
+{
+    return ((uint64_t)end << 32) | begin;
+}
+
+bool TakeBatchFile(BatchQueue *queue, uint32_t *position)
+{
+    uint64_t range = __atomic_load_n(&queue->range, __ATOMIC_ACQUIRE);
+    for(;;)
+    {
+        uint32_t begin = (uint32_t)range;
+        uint32_t end = (uint32_t)(range >> 32);
+        if(begin >= end)
+        {
+            return false;
+        }
+
+        if(__atomic_compare_exchange_n(&queue->range, &range, PackBatchRange(begin + 1, end), true,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            *position = begin;
+            return true;
+        }
+    }
+}
+
+// NOTE only called by the owner of an empty queue, the stolen positions were never seen by
+// anyone else so a thief that read an old range of that queue can't succeed with its CAS
+bool StealBatchFiles(BatchQueue *victim, BatchQueue *queue)
+{
+    uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+    for(;;)
+    {
+        uint32_t begin = (uint32_t)range;
+        uint32_t end = (uint32_t)(range >> 32);
+        if(begin >= end)
+        {
+            return false;
+        }
+
+        uint32_t middle = begin + (end - begin) / 2;
+        if(__atomic_compare_exchange_n(&victim->range, &range, PackBatchRange(begin, middle), true,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            __atomic_store_n(&queue->range, PackBatchRange(middle, end), __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+}
+
+struct BatchWorker
+{
+    pthread_t thread;
+    int index;
+
+    BatchOptions *options;
+    BatchFileVector *files;
+    uint32_t *schedule;
+    BatchQueue *queues;
+    int num_workers;
+
+    ParseState state;
+    OutputBuffer out;
+
+    size_t num_bytes;
+    size_t num_pairs;
+};
+
+// NOTE a record is the path, the status (0 parsed, 1 unreadable), the parse time in
+// nanoseconds and the pairs, each one as the byte offsets of its brackets and its level
+void ParseBatchFile(BatchWorker *worker, BatchFile *file)
+{
+    OutputBuffer *out = &worker->out;
+    file->worker = worker->index;
+    file->record_offset = out->length;
+
+    String source_code = MapSource(file->path);
+
+    uint32_t path_length = strlen(file->path);
+    uint32_t status = source_code.data ? 0 : 1;
+    Append(out, (const char *)&path_length, sizeof(path_length));
+    Append(out, file->path, path_length);
+    Append(out, (const char *)&status, sizeof(status));
+
+    uint64_t parse_time = 0;
+    uint32_t num_pairs = 0;
+    if(!source_code.data)
+    {
+        Append(out, (const char *)&parse_time, sizeof(parse_time));
+        Append(out, (const char *)&num_pairs, sizeof(num_pairs));
+        file->record_length = out->length - file->record_offset;
+        return;
     }
 
-    r = AdvanceParsing(c, pound_if_one_words, 4, parser->pound_if_one);
-    parser->pound_if_one = r.cursor;
-    if(r.end)
+    // NOTE the files are already parsed in parallel, each one is parsed by a single thread
+    RainbowOptions options = {};
+    options.num_threads = 1;
+    options.filetype = file->filetype;
+    options.check_templates = worker->options->check_templates;
+    options.check_pound_ifs = worker->options->check_pound_ifs;
+    options.defines = worker->options->defines;
+    options.languages = worker->options->languages;
+
+    uint64_t start = GetNanoseconds();
+    ParseSource(&source_code, &options, &worker->state);
+    parse_time = GetNanoseconds() - start;
+
+    PairVector result = worker->state.result;
+    num_pairs = result.len;
+    Append(out, (const char *)&parse_time, sizeof(parse_time));
+    Append(out, (const char *)&num_pairs, sizeof(num_pairs));
+
+    // NOTE the records are packed, the paths leave the pairs unaligned
+    Reserve(out, out->length + num_pairs * 3 * sizeof(uint32_t));
+    char *c = out->data + out->length;
+    for(int k = 0; k < result.len; ++k)
     {
-        parser->pound_if_level++;
-        parser->pound_if_stack[parser->pound_if_level] = 1;
-
-        found_zero_or_one = true;
+        uint32_t pair[3];
+        pair[0] = result.open[k];
+        pair[1] = result.close[k];
+        pair[2] = result.level[k];
+        memcpy(c, pair, sizeof(pair));
+        c += sizeof(pair);
     }
+    out->length = c - out->data;
 
-    r = AdvanceParsing(c, pound_if_zero_words, 4, parser->pound_if_zero);
-    parser->pound_if_zero = r.cursor;
-    if(r.end)
-    {
-        parser->pound_if_level++;
-        parser->pound_if_stack[parser->pound_if_level] = 0;
-        parser->stop_highlighting = true;
+    file->record_length = out->length - file->record_offset;
+    worker->num_bytes += source_code.length;
+    worker->num_pairs += num_pairs;
 
-        found_zero_or_one = true;
-    }
+    Free(&source_code);
+}
+
+void *RunBatchWorker(void *data)
+{
+    BatchWorker *worker = (BatchWorker *)data;
+    BatchQueue *queue = &worker->queues[worker->index];
 
-    if(check_for_not_zero_one_if)
+    for(;;)
     {
-        if(parser->pound_if_zero.a == 0 && parser->pound_if_one.a == 0 && !found_zero_or_one)
+        uint32_t position;
+        while(TakeBatchFile(queue, &position))
+        {
+            ParseBatchFile(worker, &worker->files->array[worker->schedule[position]]);
+        }
+
+        bool stolen = false;
+        for(int i = 1; i < worker->num_workers && !stolen; ++i)
+        {
+            BatchQueue *victim = &worker->queues[(worker->index + i) % worker->num_workers];
+            stolen = StealBatchFiles(victim, queue);
+        }
+
+        if(!stolen)
         {
-            parser->pound_if_level++;
-            parser->pound_if_stack[parser->pound_if_level] = 2;
+            return NULL;
         }
     }
+}
+
+int CompareBatchFilePaths(const void *a, const void *b)
+{
+    return strcmp(((BatchFile *)a)->path, ((BatchFile *)b)->path);
+}
+
+BatchFile *batch_files_to_sort;
+
+int CompareBatchFileSizes(const void *a, const void *b)
+{
+    size_t size_a = batch_files_to_sort[*(uint32_t *)a].size;
+    size_t size_b = batch_files_to_sort[*(uint32_t *)b].size;
+    return (size_a < size_b) - (size_a > size_b);
+}
 
-    if(parser->pound_if_level >= 0)
+// NOTE rainbower --batch <index> [-j threads] [-m ext=filetype]... [-g glob] [-t Y|n] [-p Y|n]
+// [-D define]... <files and directories>...
+bool ParseBatchOptions(int argc, const char **argv, BatchOptions *options)
+{
+    if(argc < 1)
     {
-        r = AdvanceParsing(c, endif_words, 2, parser->pound_endif);
-        parser->pound_endif = r.cursor;
+        return false;
+    }
 
-        if(r.end)
+    options->index_path = argv[0];
+    options->num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    options->file_types = (FileTypeMapping *)malloc((argc + NUM_DEFAULT_FILE_TYPES) * sizeof(FileTypeMapping));
+    options->num_file_types = 0;
+    options->glob = NULL;
+    options->check_templates = 'n';
+    options->check_pound_ifs = 'Y';
+    options->defines.names = (const char **)malloc(argc * sizeof(const char *));
+    options->defines.count = 0;
+
+    int i = 1;
+    for(; i + 1 < argc && argv[i][0] == '-' && argv[i][1] && !argv[i][2]; i += 2)
+    {
+        const char *value = argv[i + 1];
+        switch(argv[i][1])
         {
-            parser->stop_highlighting = false;
-            for(int i = 0; i < parser->pound_if_level; ++i)
+            case 'j': options->num_threads = atoi(value); break;
+            case 'g': options->glob = value; break;
+            case 't': options->check_templates = value[0]; break;
+            case 'p': options->check_pound_ifs = value[0]; break;
+            case 'D': options->defines.names[options->defines.count++] = value; break;
+            case 'm':
             {
-                if(parser->pound_if_stack[i] == 0)
+                const char *equals = strchr(value, '=');
+                if(!equals)
                 {
-                    parser->stop_highlighting = true;
-                    break;
+                    return false;
                 }
+                // NOTE the extension is cut out of the argument itself
+                ((char *)equals)[0] = 0;
+                options->file_types[options->num_file_types++] = {value, equals + 1};
+                break;
             }
-            parser->pound_if_level--;
+            default: return false;
         }
+    }
+
+    for(int k = 0; k < NUM_DEFAULT_FILE_TYPES; ++k)
+    {
+        options->file_types[options->num_file_types++] = default_file_types[k];
+    }
+
+    if(options->num_threads < 1)
+    {
+        options->num_threads = 1;
+    }
+
+    options->paths = argv + i;
+    options->num_paths = argc - i;
+
+    return options->num_paths > 0;
+}
+
+// NOTE the index starts with "RBIX", the version and the number of files, followed by the
+// records of the files sorted by path
+int RunBatch(int argc, const char **argv)
+{
+    BatchOptions options = {};
+    if(!ParseBatchOptions(argc, argv, &options))
+    {
+        fprintf(stderr, "usage: rainbower --batch <index> [-j threads] [-m ext=filetype]... [-g glob] "
+                        "[-t Y|n] [-p Y|n] [-D define]... <files and directories>...\n");
+        free(options.file_types);
+        free(options.defines.names);
+        return -1;
+    }
+
+    uint64_t start = GetNanoseconds();
+
+    char *languages_path = FindLanguagesFile();
+    options.languages = LoadLanguages(languages_path, NULL);
+    free(languages_path);
+
+    BatchFileVector files = {};
+    for(int i = 0; i < options.num_paths; ++i)
+    {
+        CollectBatchFiles(&options, &files, options.paths[i], true);
+    }
+    if(files.len > 0)
+    {
+        qsort(files.array, files.len, sizeof(BatchFile), CompareBatchFilePaths);
+    }
+
+    // NOTE the biggest files are dealt first and round robin, so every worker starts with a
+    // similar amount of work and what gets stolen is the small files at the back
+    int num_workers = options.num_threads;
+    uint32_t *order = (uint32_t *)malloc((files.len + 1) * sizeof(uint32_t));
+    uint32_t *schedule = (uint32_t *)malloc((files.len + 1) * sizeof(uint32_t));
+    for(int i = 0; i < files.len; ++i)
+    {
+        order[i] = i;
+    }
+    batch_files_to_sort = files.array;
+    qsort(order, files.len, sizeof(uint32_t), CompareBatchFileSizes);
 
-        char else_value = 2;
-        if(parser->pound_if_stack[parser->pound_if_level] == 1)
+    BatchQueue *queues = (BatchQueue *)aligned_alloc(64, num_workers * sizeof(BatchQueue));
+    uint32_t begin = 0;
+    for(int w = 0; w < num_workers; ++w)
+    {
+        uint32_t count = 0;
+        for(int k = w; k < files.len; k += num_workers)
         {
-            else_value = 0;
+            schedule[begin + count++] = order[k];
         }
-        else if(parser->pound_if_stack[parser->pound_if_level] == 0)
+        queues[w].range = PackBatchRange(begin, begin + count);
+        begin += count;
+    }
+
+    BatchWorker *workers = (BatchWorker *)calloc(num_workers, sizeof(BatchWorker));
+    for(int w = 0; w < num_workers; ++w)
+    {
+        BatchWorker *worker = &workers[w];
+        worker->index = w;
+        worker->options = &options;
+        worker->files = &files;
+        worker->schedule = schedule;
+        worker->queues = queues;
+        worker->num_workers = num_workers;
+    }
+
+    // NOTE the calling thread is the first worker
+    for(int w = 1; w < num_workers; ++w)
+    {
+        if(pthread_create(&workers[w].thread, NULL, RunBatchWorker, &workers[w]) != 0)
         {
-            else_value = 1;
+            workers[w].thread = 0;
         }
+    }
+    RunBatchWorker(&workers[0]);
 
-        r = AdvanceParsing(c, else_words, 2, parser->pound_else);
-        parser->pound_else = r.cursor;
-        if(r.end)
+    size_t num_bytes = 0;
+    size_t num_pairs = 0;
+    for(int w = 0; w < num_workers; ++w)
+    {
+        if(w > 0 && workers[w].thread)
         {
-            parser->pound_if_stack[parser->pound_if_level] = else_value;
-            if(else_value == 0)
-            {
-                parser->stop_highlighting = true;
-            }
-            else
-            {
-                parser->stop_highlighting = false;
-                for(int i = 0; i < parser->pound_if_level; ++i)
-                {
-                    if(parser->pound_if_stack[i] == 0)
-                    {
-                        parser->stop_highlighting = true;
-                        break;
-                    }
-                }
-            }
+            pthread_join(workers[w].thread, NULL);
         }
+        num_bytes += workers[w].num_bytes;
+        num_pairs += workers[w].num_pairs;
+    }
+
+    uint64_t parse_time = GetNanoseconds() - start;
+
+    OutputBuffer index = {};
+    uint32_t version = 1;
+    uint32_t num_files = files.len;
+    Append(&index, "RBIX", 4);
+    Append(&index, (const char *)&version, sizeof(version));
+    Append(&index, (const char *)&num_files, sizeof(num_files));
+    for(int i = 0; i < files.len; ++i)
+    {
+        BatchFile *file = &files.array[i];
+        Append(&index, workers[file->worker].out.data + file->record_offset, file->record_length);
+    }
+
+    int result = 0;
+    int fd = (strcmp(options.index_path, "-") == 0) ? STDOUT_FILENO :
+        open(options.index_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || !WriteAll(fd, index.data, index.length))
+    {
+        fprintf(stderr, "rainbower: can't write %s\n", options.index_path);
+        result = -1;
+    }
+    if(fd >= 0 && fd != STDOUT_FILENO)
+    {
+        close(fd);
+    }
+
+    double seconds = parse_time / 1e9;
+    fprintf(stderr, "rainbower: %d files, %.1f MB, %zu pairs in %.1f ms with %d threads (%.1f MB/s)\n",
+            files.len, num_bytes / 1e6, num_pairs, seconds * 1e3, num_workers,
+            seconds > 0 ? num_bytes / 1e6 / seconds : 0.0);
+
+    for(int w = 0; w < num_workers; ++w)
+    {
+        Free(&workers[w].state);
+        Free(&workers[w].out);
     }
+    Free(&index);
+    free(workers);
+    free(queues);
+    free(schedule);
+    free(order);
+    Free(&files);
+    Free(options.languages);
+    free(options.file_types);
+    free(options.defines.names);
+
+    return result;
 }
 
-struct String
+// NOTE: the server keeps one BufferState per kakoune buffer so that an idle event only costs
+// a round-trip on the socket, the client sends its arguments and the buffer contents and gets
+// back the command that has to be piped into kak -p
+#define MESSAGE_REQUEST 'R'
+#define MESSAGE_REQUEST_FILE 'M'
+// NOTE a request without the buffer, the server answers from its last parse of the buffer when
+// it was for the same timestamp and options, and with an empty reply when it wasn't
+#define MESSAGE_REQUEST_CACHED 'C'
+#define MESSAGE_FORGET 'F'
+#define MESSAGE_QUIT 'Q'
+#define MESSAGE_HISTOGRAM 'H'
+
+// NOTE the byte after the type of a request, with REQUEST_BUDGET the milliseconds left of the
+// latency budget follow it as a uint32
+#define REQUEST_STATS 1
+#define REQUEST_BUDGET 2
+
+struct BufferState
 {
-    char *data;
-    size_t length;
+    char *buffile;
+    char *filetype;
+    char check_templates;
+    char check_pound_ifs;
+    char *defines;
+    char *timestamp;
+
+    String source;
+
+    // NOTE the next run parses into the other state so the current one can be used as the old
+    // one, the arenas are kept for the lifetime of the buffer
+    ParseState parses[2];
+    int current;
+
+    // NOTE mapped the first time the buffer is parsed
+    JobSlot job;
+
+    BufferState *next;
 };
 
-CharPositionVector ParseCTemplates(char *buffer)
+BufferState *FindBufferState(BufferState **states, const char *buffile, bool create)
 {
-    IntPair cur_pos = { 1, 1 };
-    CharPositionVector templates = {};
-
-    for(const char *c = buffer; *c != '\0'; c++)
+    for(BufferState *state = *states; state; state = state->next)
     {
-        if(*c == ';' || *c == '{' || *c == '.' || *c == '*')
+        if(strcmp(state->buffile, buffile) == 0)
         {
-            while(DeleteLessThanSign(&templates));
+            return state;
         }
-        if(*c == '\n')
+    }
+
+    if(!create)
+    {
+        return NULL;
+    }
+
+    BufferState *state = (BufferState *)calloc(1, sizeof(BufferState));
+    state->buffile = CopyString(buffile);
+    state->next = *states;
+    *states = state;
+
+    return state;
+}
+
+void ResetBufferState(BufferState *state)
+{
+    free(state->filetype);
+    free(state->defines);
+    free(state->timestamp);
+    free(state->source.data);
+
+    state->filetype = NULL;
+    state->defines = NULL;
+    state->timestamp = NULL;
+    state->source = {};
+}
+
+void RemoveBufferState(BufferState **states, const char *buffile)
+{
+    for(BufferState **s = states; *s; s = &(*s)->next)
+    {
+        if(strcmp((*s)->buffile, buffile) == 0)
         {
-            cur_pos.a++;
-            cur_pos.b = 1;
+            BufferState *state = *s;
+            *s = state->next;
+
+            ResetBufferState(state);
+            Free(&state->parses[0]);
+            Free(&state->parses[1]);
+            Free(&state->job);
+            free(state->buffile);
+            free(state);
+            break;
         }
-        else
-        {
-            CharPosition p = {};
-            p.c = *c;
-            p.pair = cur_pos;
+    }
+}
 
-            if(*c == '<')
-            {
-                Insert(&templates, p);
-            }
-            else if(*c == '>')
-            {
-                if(NumPairable(templates) > 0)
-                {
-                    // NOTE ignore arrow
-                    if(*(c - 1) != '-')
-                    {
-                        Insert(&templates, p);
-                    }
-                }
-            }
-            cur_pos.b++;
+// NOTE the defines are only compared, so they are kept as one string
+char *JoinDefines(PoundIfDefines *defines)
+{
+    size_t length = 1;
+    for(int i = 0; i < defines->count; ++i)
+    {
+        length += strlen(defines->names[i]) + 1;
+    }
+
+    char *joined = (char *)malloc(length);
+    char *c = joined;
+    for(int i = 0; i < defines->count; ++i)
+    {
+        size_t name_length = strlen(defines->names[i]);
+        memcpy(c, defines->names[i], name_length);
+        c += name_length;
+        *c++ = '\n';
+    }
+    *c = '\0';
+
+    return joined;
+}
+
+bool IsSameDefines(const char *joined, PoundIfDefines *defines)
+{
+    for(int i = 0; i < defines->count; ++i)
+    {
+        size_t length = strlen(defines->names[i]);
+        if(strncmp(joined, defines->names[i], length) != 0 || joined[length] != '\n')
+        {
+            return false;
         }
+        joined += length + 1;
     }
 
-    return templates;
+    return (*joined == '\0');
 }
 
-CharPositionVector ParseCFile(String *string, bool check_templates, bool check_pound_ifs)
+bool IsSameOptions(BufferState *state, RainbowOptions *options)
 {
-    IntPair cur_pos = { 1, 1 };
+    return (state->source.data &&
+            state->check_templates == options->check_templates &&
+            state->check_pound_ifs == options->check_pound_ifs &&
+            strcmp(state->filetype, options->filetype) == 0 &&
+            IsSameDefines(state->defines, &options->defines));
+}
 
-    StringParsingInfo info;
+bool IsSameParse(BufferState *state, RainbowOptions *options, String *source_code)
+{
+    return (IsSameOptions(state, options) &&
+            state->source.length == source_code->length &&
+            memcmp(state->source.data, source_code->data, source_code->length) == 0);
+}
 
-    info.current_string = '\0';
-    info.current_string_count = 0;
+bool IsSameTimestamp(BufferState *state, RainbowOptions *options)
+{
+    return (state && IsSameOptions(state, options) && state->timestamp &&
+            strcmp(state->timestamp, options->timestamp) == 0);
+}
 
-    const char *multiline_comment = NULL;
+// NOTE the strings are arguments and paths, a longer one is a broken or hostile client
+#define MESSAGE_MAX_STRING (1024 * 1024)
 
-    bool line_comment = false;
-    const char *last_closed_comment = 0;
+bool ReadMessageString(int fd, char **string)
+{
+    *string = NULL;
+    uint32_t length;
+    if(!ReadAll(fd, &length, sizeof(length)) || length > MESSAGE_MAX_STRING)
+    {
+        return false;
+    }
 
-    PoundIfParsing parser = {};
-    parser.pound_if_level = -1;
+    *string = (char *)malloc((size_t)length + 1);
+    if(!*string)
+    {
+        return false;
+    }
+    (*string)[length] = 0;
 
-    char *buffer = (char *)malloc(string->length + 1);
-    char *dc = buffer;
-    buffer[string->length] = 0;
+    return ReadAll(fd, *string, length);
+}
 
-    int i = 0;
-    for(const char *c = string->data; *c != '\0'; c++, dc++, i++)
+bool WriteMessageString(int fd, const char *string)
+{
+    uint32_t length = strlen(string);
+    return WriteAll(fd, &length, sizeof(length)) && WriteAll(fd, string, length);
+}
+
+// NOTE the next request is compared with the buffer, so the state keeps its own copy of a file
+// that was mapped, it could be written over while it's mapped
+String CopySource(String *source_code)
+{
+    if(!source_code->mapped_size)
     {
-        bool should_check_char = false;
+        return *source_code;
+    }
 
-        if(*c == '\n')
+    String copy = {};
+    copy.data = (char *)malloc(source_code->length + 1);
+    copy.length = source_code->length;
+    memcpy(copy.data, source_code->data, source_code->length + 1);
+    Free(source_code);
+
+    return copy;
+}
+
+// NOTE an empty reply is a request the server has no ranges for, cached or superseded ones,
+// the client then prints fail or nothing
+void WriteEmptyReply(int fd)
+{
+    uint64_t reply_size = 0;
+    WriteAll(fd, &reply_size, sizeof(reply_size));
+}
+
+// NOTE a parse that fell back on its latency budget only answers the requests with the same
+// budget or a smaller one, the others parse the buffer again, or get an empty reply when they
+// didn't send it so the client falls back to sending it
+bool IsReusableParse(ParseState *parse, LatencyBudget *budget)
+{
+    return parse->fallback == BUDGET_EXACT || (budget && budget->ms <= parse->fallback_ms);
+}
+
+// NOTE with map_file the client only sends the arguments and the server maps the file, when
+// the request fails the connection is closed without a reply and the client parses it itself
+// NOTE a request superseded by a newer timestamp of the buffer gets an empty reply, before or
+// after it's parsed, and its parse is dropped so the next one still resumes from the last one
+void HandleRequest(int fd, BufferState **states, OutputBuffer *out, char type, Language *languages,
+                   const char *socket_path)
+{
+    uint8_t flags;
+    uint32_t budget_ms = 0;
+    uint32_t argc;
+    if(!ReadAll(fd, &flags, sizeof(flags)) ||
+       ((flags & REQUEST_BUDGET) && !ReadAll(fd, &budget_ms, sizeof(budget_ms))) ||
+       !ReadAll(fd, &argc, sizeof(argc)) || argc > 4096)
+    {
+        return;
+    }
+
+    RunStats run_stats = {};
+    RunStats *stats = (flags & REQUEST_STATS) ? &run_stats : NULL;
+    uint64_t start = StartPhase(stats);
+    LatencyBudget run_budget;
+    LatencyBudget *budget = StartBudget(&run_budget, budget_ms);
+
+    const char **argv = (const char **)calloc(argc + 1, sizeof(char *));
+    bool ok = true;
+    for(uint32_t i = 0; i < argc && ok; ++i)
+    {
+        ok = ReadMessageString(fd, (char **)&argv[i]);
+    }
+
+    uint64_t length = 0;
+    String source_code = {};
+    if(ok && type == MESSAGE_REQUEST_FILE)
+    {
+        if(argc > 1)
         {
-            cur_pos.a++;
-            cur_pos.b = 1;
-            line_comment = false;
+            source_code = MapSource(argv[1]);
+        }
+        ok = (source_code.data != NULL);
+    }
+    else if(ok && type == MESSAGE_REQUEST && ReadAll(fd, &length, sizeof(length)) && length <= UINT32_MAX)
+    {
+        // NOTE larger buffers are not highlighted anyway, see ParseSource
+        source_code.data = (char *)malloc(length + 1);
+        source_code.length = length;
+        ok = (source_code.data && ReadAll(fd, source_code.data, length));
+        if(ok)
+        {
+            source_code.data[length] = 0;
+        }
+    }
+    else if(type != MESSAGE_REQUEST_CACHED)
+    {
+        ok = false;
+    }
+    FinishPhase(stats, PHASE_READ, start, source_code.length);
 
-            should_check_char = true;
+    RainbowOptions options;
+    if(ok && ParseOptions(argc, argv, &options))
+    {
+        options.num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        options.languages = languages;
+        options.keep_masked = true;
+        BufferState *state = FindBufferState(states, options.buffile, type != MESSAGE_REQUEST_CACHED);
+        if(state && !state->job.latest)
+        {
+            OpenJobSlot(&state->job, socket_path, options.buffile);
         }
-        else
+
+        if(type == MESSAGE_REQUEST_CACHED &&
+           (!IsSameTimestamp(state, &options) || !IsReusableParse(&state->parses[state->current], budget)))
         {
-            CharPosition p = {};
-            p.c = *c;
-            p.pair = cur_pos;
-            if(check_pound_ifs && parser.pound_if_level >= 0 && (parser.pound_if_stack[parser.pound_if_level] == 0))
-            {
-                ParsePoundIfs(*c, &parser);
-            }
-            else if(parser.stop_highlighting)
-            {
-                ParsePoundIfs(*c, &parser);
-            }
-            else if(line_comment)
-            {
-            }
-            else if(multiline_comment)
+            WriteEmptyReply(fd);
+            state = NULL;
+        }
+        else if(type != MESSAGE_REQUEST_CACHED && !ClaimJobSlot(&state->job, options.timestamp))
+        {
+            Free(&source_code);
+            WriteEmptyReply(fd);
+            state = NULL;
+        }
+        else if(type == MESSAGE_REQUEST_CACHED ||
+                (IsSameParse(state, &options, &source_code) &&
+                 IsReusableParse(&state->parses[state->current], budget)))
+        {
+            Free(&source_code);
+            free(state->timestamp);
+            state->timestamp = CopyString(options.timestamp);
+            if(stats)
             {
-                if(CCheckCloseMultilineComment(c, multiline_comment))
-                {
-                    multiline_comment = NULL;
-                    last_closed_comment = c;
-                }
+                CollectStats(stats, &state->parses[state->current], state->source.length, 0);
             }
-            else if(info.current_string == '\0' && CCheckStartMultilineComment(c, string->data, last_closed_comment))
+        }
+        else
+        {
+            ParseState *old = &state->parses[state->current];
+            ParseState *parse = &state->parses[1 - state->current];
+            parse->stats = stats;
+            parse->job = &state->job;
+            parse->budget = budget;
+            if(IsSameOptions(state, &options) && old->fallback < BUDGET_NO_TEMPLATES)
             {
-                multiline_comment = c;
+                ParseEdit edit;
+                ComputeEdit(&state->source, &source_code, &old->bracket_checkpoints, &edit);
+                ParseSource(&source_code, &options, parse, old, &edit);
             }
-            else if(info.current_string == '\0' && CCheckStartLineComment(c, string->data, last_closed_comment))
+            else
             {
-                line_comment = true;
+                ParseCached(&source_code, &options, parse);
             }
-            else if(info.current_string == '\0')
-            {
-                if(check_pound_ifs)
-                {
-                    ParsePoundIfs(*c, &parser);
-                }
-
-                should_check_char = true;
+            parse->stats = NULL;
+            parse->job = NULL;
+            parse->budget = NULL;
 
-                if(p.c == '\'' || p.c == '\"')
-                {
-                    info.current_string = *c;
-                }
+            if(IsSuperseded(&state->job))
+            {
+                Free(&source_code);
+                WriteEmptyReply(fd);
+                state = NULL;
             }
-            else if(info.current_string)
+            else
             {
-                CContinueString(&info, c);
+                ResetBufferState(state);
+                state->current = 1 - state->current;
+                state->source = CopySource(&source_code);
+                state->filetype = CopyString(options.filetype);
+                state->check_templates = options.check_templates;
+                state->check_pound_ifs = options.check_pound_ifs;
+                state->defines = JoinDefines(&options.defines);
+                state->timestamp = CopyString(options.timestamp);
             }
-            cur_pos.b++;
         }
 
-        if(!should_check_char)
-        {
-            *dc = ' ';
-        }
-        else
+        // NOTE the reply size goes in front of the output so it's all sent at once
+        if(state)
         {
-            *dc = *c;
+            uint64_t reply_size = 0;
+            out->length = 0;
+            Append(out, (const char *)&reply_size, sizeof(reply_size));
+            ParseState *parse = &state->parses[state->current];
+            start = StartPhase(stats);
+            parse->budget = budget;
+            PrintRanges(out, &options, parse);
+            parse->budget = NULL;
+            FinishPhase(stats, PHASE_OUTPUT, start, out->length - sizeof(reply_size));
+            if(stats)
+            {
+                PrintStats(out, &options, stats);
+            }
+
+            reply_size = out->length - sizeof(reply_size);
+            memcpy(out->data, &reply_size, sizeof(reply_size));
+            WriteAll(fd, out->data, out->length);
         }
     }
-
-    CharPositionVector templates = {};
-
-    if(check_templates)
+    else
     {
-        templates = ParseCTemplates(buffer);
+        Free(&source_code);
     }
 
-    CharPair template_pair;
-    template_pair.a = '<';
-    template_pair.b = '>';
-    CharPositionVector result = ParseGenericFile(buffer, templates, template_pair);
-
-    Free(&templates);
-    free(buffer);
-
-    return result;
+    for(uint32_t i = 0; i < argc; ++i)
+    {
+        free((char *)argv[i]);
+    }
+    free(argv);
 }
 
-struct MultilineCommentsStack
+// NOTE the time the server took for the last requests of the session, in microseconds
+#define LATENCY_HISTORY 1024
+#define LATENCY_BUCKETS 16
+
+struct LatencyHistory
 {
-    const char *ptr;
-    MultilineCommentsStack *previous;
+    uint32_t latencies[LATENCY_HISTORY];
+    int count;
+    int next;
 };
 
-void PushCommentLevel(MultilineCommentsStack **s, const char *ptr)
+void AddLatency(LatencyHistory *history, uint64_t ns)
 {
-    MultilineCommentsStack *new_element = (MultilineCommentsStack*)malloc(sizeof(MultilineCommentsStack));
-
-    if(new_element)
+    uint64_t us = ns / 1000;
+    history->latencies[history->next] = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+    history->next = (history->next + 1) % LATENCY_HISTORY;
+    if(history->count < LATENCY_HISTORY)
     {
-        new_element->ptr = ptr;
-        new_element->previous = *s;
+        history->count++;
     }
-
-    *s = new_element;
 }
 
-void PopCommentLevel(MultilineCommentsStack **s)
+int CompareLatencies(const void *a, const void *b)
 {
-    if(*s)
-    {
-        MultilineCommentsStack *previous = (*s)->previous;
-
-        free(*s);
-
-        *s = previous;
-    }
+    uint32_t latency_a = *(const uint32_t *)a;
+    uint32_t latency_b = *(const uint32_t *)b;
+    return (latency_a > latency_b) - (latency_a < latency_b);
 }
 
-void Free(MultilineCommentsStack **s)
+// NOTE buckets doubling from 0.1ms, the last one has everything slower
+void PrintLatencyHistogram(OutputBuffer *out, LatencyHistory *history)
 {
-    while(*s)
+    char line[256];
+    if(history->count == 0)
     {
-        PopCommentLevel(s);
+        Append(out, "no requests yet\n");
+        return;
     }
-}
 
-void RustContinueString(StringParsingInfo *info, const char *c)
-{
-    if(info->current_string == '\'' && *c == 'x' && *(c - 1) == '\\')
-    {
-        info->current_string = 'x';
-    }
-    // NOTE the first check checks for the lifetime specifier
-    else if((info->current_string == '\'' && info->current_string_count == 1) ||
-            ((info->current_string == '\'' && *c == '\'') &&
-            (*(c - 1) != '\\' || *(c - 2) == '\\')))
+    uint32_t sorted[LATENCY_HISTORY];
+    memcpy(sorted, history->latencies, history->count * sizeof(uint32_t));
+    qsort(sorted, history->count, sizeof(uint32_t), CompareLatencies);
+
+    int counts[LATENCY_BUCKETS] = {};
+    for(int i = 0; i < history->count; ++i)
     {
-        info->current_string = '\0';
-        info->current_string_count = 0;
-        info->closed_string = true;
+        int bucket = 0;
+        while(bucket < LATENCY_BUCKETS - 1 && sorted[i] >= (100u << bucket))
+        {
+            bucket++;
+        }
+        counts[bucket]++;
     }
-    else if((info->current_string == '\"' && *c == '\"') &&
-            (*(c - 1) != '\\' || *(c - 2) == '\\'))
+
+    int count = history->count;
+    snprintf(line, sizeof(line), "last %d requests: p50 %.2fms p90 %.2fms p99 %.2fms max %.2fms\n", count,
+             sorted[count / 2] / 1e3, sorted[count * 9 / 10] / 1e3, sorted[count * 99 / 100] / 1e3,
+             sorted[count - 1] / 1e3);
+    Append(out, line);
+
+    int first = 0;
+    int last = LATENCY_BUCKETS - 1;
+    while(counts[first] == 0)
     {
-        info->current_string = '\0';
-        info->current_string_count = 0;
-        info->closed_string = true;
+        first++;
     }
-    else if(info->current_string == 'x' && (*c == '\'' || *c < '0' || *c > '9'))
+    while(counts[last] == 0)
     {
-        info->current_string = '\0';
-        info->current_string_count = 0;
-        info->closed_string = true;
+        last--;
     }
-    else if(*(c) != '\\' || *(c - 1) == '\\')
+    int max_count = 0;
+    for(int bucket = first; bucket <= last; ++bucket)
     {
-        info->current_string_count += 1;
+        max_count = (counts[bucket] > max_count) ? counts[bucket] : max_count;
     }
-}
-
-bool RustCheckCloseMultilineComment(const char *c, const char *multiline_comment)
-{
-    return (*c == '/' && *(c - 1) == '*' && c != multiline_comment + 1);
-}
-
-bool RustCheckStartMultilineComment(const char *c, const char *buffer, const char *last_closed_comment)
-{
-    return (last_closed_comment != (c - 1) && *c == '*' && c != buffer && *(c - 1) == '/');
-}
-
-bool RustCheckStartLineComment(const char *c, const char *buffer, const char *last_closed_comment)
-{
-    return (last_closed_comment != (c - 1) && *c == '/' && c != buffer && *(c - 1) == '/');
-}
-
-CharPositionVector ParseRustGenerics(char *buffer)
-{
-    CharPositionVector generics = {};
-    IntPair cur_pos = { 1, 1 };
 
-    for(const char *c = buffer; *c != '\0'; c++)
+    for(int bucket = first; bucket <= last; ++bucket)
     {
-        if(*c == '{' || *c == '|' || *c == '^' || *c == '!')
+        if(bucket < LATENCY_BUCKETS - 1)
         {
-            while(DeleteLessThanSign(&generics));
+            snprintf(line, sizeof(line), "< %8.1fms %5d ", (100u << bucket) / 1e3, counts[bucket]);
         }
-        if(*c == '\n')
+        else
         {
-            cur_pos.a++;
-            cur_pos.b = 1;
+            snprintf(line, sizeof(line), ">=%8.1fms %5d ", (100u << (bucket - 1)) / 1e3, counts[bucket]);
         }
-        else
+        Append(out, line);
+        int width = (counts[bucket] * 40 + max_count - 1) / max_count;
+        for(int i = 0; i < width; ++i)
         {
-            CharPosition p = {};
-            p.c = *c;
-            p.pair = cur_pos;
-            if(*c == '<')
-            {
-                Insert(&generics, p);
-            }
-            else if(p.c == '>')
-            {
-                if(NumPairable(generics) > 0)
-                {
-                    if(*(c - 1) != '-')
-                    {
-                        Insert(&generics, p);
-                    }
-                }
-            }
-            cur_pos.b++;
+            Append(out, "#");
         }
+        Append(out, "\n");
     }
-
-    return generics;
 }
 
-CharPositionVector ParseRustFile(String *string, bool check_generics)
+int RunServer(const char *socket_path)
 {
-    IntPair cur_pos = { 1, 1 };
+    sockaddr_un address;
+    if(!SetSocketAddress(&address, socket_path) || !IsPrivateSocketDirectory(socket_path))
+    {
+        return -1;
+    }
 
-    int level = 0;
+    int running = ConnectToServer(socket_path);
+    if(running >= 0)
+    {
+        // NOTE there is already a server for this session
+        close(running);
+        return 0;
+    }
 
-    StringParsingInfo info;
-    info.current_string = '\0';
-    info.current_string_count = 0;
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0)
+    {
+        return -1;
+    }
+
+    unlink(socket_path);
+    if(bind(listen_fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(listen_fd, 16) != 0)
+    {
+        close(listen_fd);
+        return -1;
+    }
 
-    MultilineCommentsStack *multiline_comment = NULL;
+    pid_t pid = fork();
+    if(pid != 0)
+    {
+        close(listen_fd);
+        return (pid < 0) ? -1 : 0;
+    }
 
-    bool line_comment = false;
-    const char *last_closed_comment = 0;
+    RemoveJobSlots(socket_path);
 
-    char *buffer = (char *)malloc(string->length + 1);
-    buffer[string->length] = 0;
-    char *dc = buffer;
+    setsid();
+    signal(SIGPIPE, SIG_IGN);
 
-    for(const char *c = string->data; *c != '\0'; c++, dc++)
+    int null_fd = open("/dev/null", O_RDWR);
+    if(null_fd >= 0)
     {
-        bool should_check_char = false;
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    }
 
-        info.closed_string = false;
+    BufferState *states = NULL;
+    OutputBuffer out = {};
+    LatencyHistory history = {};
 
-        if(*c == '\n')
-        {
-            cur_pos.a++;
-            cur_pos.b = 1;
-            line_comment = false;
+    // NOTE all the languages are compiled once for the whole session
+    char *languages_path = FindLanguagesFile();
+    Language *languages = LoadLanguages(languages_path, NULL);
+    free(languages_path);
 
-            should_check_char = true;
+    bool quit = false;
+    while(!quit)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0)
+        {
+            continue;
         }
-        else
+
+        char type = 0;
+        if(ReadAll(fd, &type, 1))
         {
-            CharPosition p = {};
-            p.c = *c;
-            p.pair = cur_pos;
-            if(line_comment)
+            if(type == MESSAGE_REQUEST || type == MESSAGE_REQUEST_FILE || type == MESSAGE_REQUEST_CACHED)
             {
+                uint64_t start = GetNanoseconds();
+                HandleRequest(fd, &states, &out, type, languages, socket_path);
+                AddLatency(&history, GetNanoseconds() - start);
             }
-            else if(info.current_string == '\0' && RustCheckStartMultilineComment(c, string->data, last_closed_comment))
+            else if(type == MESSAGE_HISTOGRAM)
             {
-                PushCommentLevel(&multiline_comment, c);
+                out.length = 0;
+                PrintLatencyHistogram(&out, &history);
+                WriteAll(fd, out.data, out.length);
             }
-            else if(multiline_comment)
+            else if(type == MESSAGE_FORGET)
             {
-                if(RustCheckCloseMultilineComment(c, multiline_comment->ptr))
+                char *buffile = NULL;
+                if(ReadMessageString(fd, &buffile))
                 {
-                    PopCommentLevel(&multiline_comment);
-                    last_closed_comment = c;
+                    RemoveBufferState(&states, buffile);
                 }
+                free(buffile);
             }
-            else if(info.current_string == '\0' && RustCheckStartLineComment(c, string->data, last_closed_comment))
-            {
-                line_comment = true;
-            }
-            else
+            else if(type == MESSAGE_QUIT)
             {
-                if(info.current_string)
-                {
-                    RustContinueString(&info, c);
-                }
-                if(info.current_string == '\0')
-                {
-                    should_check_char = true;
-                    if(!info.closed_string && (p.c == '\'' || p.c == '\"'))
-                    {
-                        info.current_string = *c;
-                    }
-                }
-                cur_pos.b++;
+                quit = true;
             }
         }
 
-        if(!should_check_char)
-        {
-            *dc = ' ';
-        }
-        else
-        {
-            *dc = *c;
-        }
+        close(fd);
     }
 
-    Free(&multiline_comment);
-
-    CharPositionVector generics = {};
-
-    if(check_generics)
+    while(states)
     {
-        generics = ParseRustGenerics(buffer);
+        RemoveBufferState(&states, states->buffile);
     }
+    Free(&out);
+    Free(languages);
 
-    CharPair generic_pair;
-    generic_pair.a = '<';
-    generic_pair.b = '>';
-    CharPositionVector result = ParseGenericFile(buffer, generics, generic_pair);
-
-    Free(&generics);
-    free(buffer);
+    close(listen_fd);
+    unlink(socket_path);
+    RemoveJobSlots(socket_path);
 
-    return result;
+    return 0;
 }
 
-#define BUFFER_SIZE 500
-
-int main(int argc, const char **argv)
+int SendServerMessage(const char *socket_path, char type, const char *string)
 {
-    const char *buffer = argv[1];
-    const char *timestamp = argv[2];
-    char mode = argv[3][0];
-
-    IntPair cursor_pair = ParsePair(argv[4]);
-    IntPair window_top = ParsePair(argv[5]);
-    IntPair window_size = ParsePair(argv[6]);
-
-    const char *filetype = argv[7];
+    int fd = ConnectToRainbower(socket_path);
+    if(fd < 0)
+    {
+        return -1;
+    }
 
-    IntPair window_bottom;
-    window_bottom.a = window_top.a + window_size.a;
-    window_bottom.b = window_top.b + window_size.b;
+    bool ok = WriteAll(fd, &type, 1);
+    if(ok && string)
+    {
+        ok = WriteMessageString(fd, string);
+    }
 
-    window_top.a -= 30;
-    window_bottom.a += 30;
+    close(fd);
 
-    char check_templates = argv[8][0];
-    char check_pound_ifs = argv[9][0];
+    return ok ? 0 : -1;
+}
 
-    int i = 10;
+// NOTE with map_file nothing is read from stdin unless the file has to be parsed here and
+// can't be mapped, with stats the server collects them for its run
+// NOTE with cached the buffer is not sent, the client prints fail for kakoune when the server
+// has not parsed this timestamp of the buffer or is not running
+// NOTE the run takes the job slot of the buffer first, a superseded run stops after reading the
+// buffer, after the server's reply or after its own parse and prints nothing
+#define CACHED_TIMEOUT_MS 100
 
-    const char **colors = argv + i;
-    int num_colors = 0;
-    for(; i < argc && argv[i][0] != '!'; ++i)
+int RunClient(const char *socket_path, int argc, const char **argv, bool map_file, bool cached, RunStats *stats,
+              const char *session, LatencyBudget *budget)
+{
+    JobSlot job = {};
+    if(argc > 2)
     {
-        num_colors++;
+        OpenJobSlot(&job, socket_path, argv[1]);
     }
-
-    const char **background_colors = argv + i;
-    int num_background_colors = 0;
-    for(; i < argc; ++i)
+    if(argc > 2 && !ClaimJobSlot(&job, argv[2]))
     {
-        num_background_colors++;
+        Free(&job);
+        return 0;
     }
 
     String source_code = {};
+    uint64_t start = StartPhase(stats);
+    if(!map_file && !cached)
+    {
+        source_code = ReadSource(STDIN_FILENO);
+    }
 
-    size_t buffer_size = BUFFER_SIZE;
-    char *string = (char *)malloc(BUFFER_SIZE);
-    size_t length = 0;
-    size_t read_size = buffer_size;
-    while(int bytes_read = read(STDIN_FILENO, string + length, read_size))
+    // NOTE kakoune waits for a cached request in its %sh{}, so it gives up on a server that is
+    // busy and the caller falls back to a request in the background
+    int fd = IsSuperseded(&job) ? -1 : ConnectToRainbower(socket_path, cached ? CACHED_TIMEOUT_MS : 0);
+    if(fd >= 0)
     {
-        length += bytes_read;
-        read_size = length*1.5;
-        if(length + read_size >= buffer_size)
+        char type = cached ? MESSAGE_REQUEST_CACHED : (map_file ? MESSAGE_REQUEST_FILE : MESSAGE_REQUEST);
+        uint8_t flags = (stats ? REQUEST_STATS : 0) | (budget ? REQUEST_BUDGET : 0);
+        uint32_t num_args = argc;
+        uint64_t length = source_code.length;
+
+        bool ok = WriteAll(fd, &type, 1) && WriteAll(fd, &flags, sizeof(flags));
+        if(budget)
         {
-            buffer_size += read_size;
-            char *result = (char *)realloc(string, buffer_size + 1);
-            if(result)
-            {
-                string = result;
-            }
+            uint32_t budget_left = GetBudgetLeft(budget);
+            ok = ok && WriteAll(fd, &budget_left, sizeof(budget_left));
+        }
+        ok = ok && WriteAll(fd, &num_args, sizeof(num_args));
+        for(int i = 0; i < argc && ok; ++i)
+        {
+            ok = WriteMessageString(fd, argv[i]);
+        }
+        if(type == MESSAGE_REQUEST)
+        {
+            ok = ok && WriteAll(fd, &length, sizeof(length)) && WriteAll(fd, source_code.data, length);
         }
-    }
 
-    string[length] = 0;
+        uint64_t reply_size = 0;
+        if(ok && ReadAll(fd, &reply_size, sizeof(reply_size)) && reply_size > 0)
+        {
+            char *reply = (char *)malloc(reply_size);
+            if(reply && ReadAll(fd, reply, reply_size))
+            {
+                WriteOutput(session, reply, reply_size);
 
-    source_code.data = string;
-    source_code.length = length;
+                free(reply);
+                close(fd);
+                Free(&source_code);
+                Free(&job);
+                return 0;
+            }
+            free(reply);
+        }
 
-    if(!source_code.data)
-    {
-        return -1;
+        close(fd);
     }
 
-    CharPositionVector result;
-    if(strcmp(filetype, "c") == 0)
+    // NOTE a superseded run leaves the ranges to the newer one
+    int result = 0;
+    if(cached && !IsSuperseded(&job))
     {
-        result = ParseCFile(&source_code, false, (check_pound_ifs == 'Y'));
+        WriteAll(STDOUT_FILENO, "fail\n", 5);
+        result = 1;
     }
-    else if(strcmp(filetype, "cpp") == 0)
+    else if(!cached && !IsSuperseded(&job))
     {
-        result = ParseCFile(&source_code, (check_templates == 'Y'), (check_pound_ifs == 'Y'));
+        // NOTE the server is not running (or went away), parse it here
+        if(map_file)
+        {
+            source_code = LoadSource(argc > 1 ? argv[1] : NULL, true);
+        }
+        FinishPhase(stats, PHASE_READ, start, source_code.length);
+        result = RunOnce(argc, argv, &source_code, stats, &job, session, NULL, budget);
     }
-    else if(strcmp(filetype, "rust") == 0)
+
+    Free(&source_code);
+    Free(&job);
+
+    return result;
+}
+
+// NOTE prints the latency histogram of the server of the session
+int RunHistogram(const char *socket_path)
+{
+    int fd = ConnectToRainbower(socket_path);
+    char type = MESSAGE_HISTOGRAM;
+    if(fd < 0 || !WriteAll(fd, &type, 1))
     {
-        result = ParseRustFile(&source_code, (check_templates == 'Y'));
+        printf("no rainbower server running\n");
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
     }
-    else
+
+    char buffer[BUFFER_SIZE];
+    ssize_t bytes_read;
+    size_t length = 0;
+    while((bytes_read = read(fd, buffer, sizeof(buffer))) > 0)
     {
-        result = ParseGenericFile(source_code.data);
+        WriteAll(STDOUT_FILENO, buffer, bytes_read);
+        length += bytes_read;
     }
+    close(fd);
 
-    CharPosition cursor_range_a = {};
-    CharPosition cursor_range_b = {};
+    // NOTE the server was stopping
+    if(length == 0)
+    {
+        printf("no rainbower server running\n");
+        return -1;
+    }
 
-    printf("evaluate-commands -buffer %s -- set-option buffer rainbow %s ", buffer, timestamp);
+    return 0;
+}
 
-    for(int k = result.len - 2; k >= 0; k -= 2)
+int main(int argc, const char **argv)
+{
+    // NOTE --mmap, --stats, --cached, --stream, --session and --budget can come before any of
+    // the other modes, with --mmap the buffile argument is mapped instead of reading the buffer
+    // from stdin, with --stats the stats of the run are sent to the *debug* buffer after the
+    // ranges, with --cached the client asks the server for its last parse of the buffer instead
+    // of sending it, with --stream a run without the server parses stdin while reading it, with
+    // --session <session> the ranges are sent to that kakoune session instead of printed, with
+    // --budget <ms> the run falls back to less exact highlighting to stay in that many ms
+    LatencyBudget run_budget;
+    uint32_t budget_ms = 0;
+    bool map_file = false;
+    bool cached = false;
+    bool streamed = false;
+    const char *session = NULL;
+    RunStats run_stats = {};
+    RunStats *stats = NULL;
+    while(argc >= 2 && (strcmp(argv[1], "--mmap") == 0 || strcmp(argv[1], "--stats") == 0 ||
+                        strcmp(argv[1], "--cached") == 0 || strcmp(argv[1], "--stream") == 0 ||
+                        (argc >= 3 && strcmp(argv[1], "--session") == 0) ||
+                        (argc >= 3 && strcmp(argv[1], "--budget") == 0)))
     {
-        CharPosition p = result.array[k + 1];
-        CharPosition p2 = result.array[k];
-        int level_index = p2.level % (num_colors);
-        const char *color = colors[level_index];
-        if(IsMaxPair(p.pair, window_top) && IsMinPair(p.pair, window_bottom))
+        int shift = 1;
+        if(strcmp(argv[1], "--budget") == 0)
         {
-            printf("%d.%d,%d.%d|%s ", p.pair.a, p.pair.b, p.pair.a, p.pair.b, color);
+            budget_ms = (uint32_t)atoi(argv[2]);
+            shift = 2;
         }
-        if(IsMaxPair(p2.pair, window_top) && IsMinPair(p2.pair, window_bottom))
+        else if(strcmp(argv[1], "--mmap") == 0)
         {
-            printf("%d.%d,%d.%d|%s ", p2.pair.a, p2.pair.b, p2.pair.a, p2.pair.b, color);
+            map_file = true;
         }
-        if(mode == '2')
+        else if(strcmp(argv[1], "--stream") == 0)
         {
-            int level_index = p2.level % (num_background_colors);
-            const char *color = background_colors[level_index];
-            if(IsRangeVisible(p.pair, p2.pair, window_top, window_bottom))
-            {
-                printf("%d.%d,%d.%d|default,%s ", p.pair.a, p.pair.b, p2.pair.a, p2.pair.b, color);
-            }
+            streamed = true;
         }
-        else if(mode == '1')
+        else if(strcmp(argv[1], "--cached") == 0)
         {
-            if(((cursor_pair.a > p.pair.a) || (cursor_pair.b >= p.pair.b && cursor_pair.a == p.pair.a)) &&
-               ((cursor_pair.a < p2.pair.a) || (cursor_pair.b <= p2.pair.b && cursor_pair.a == p2.pair.a)))
-            {
-                cursor_range_a = p;
-                cursor_range_b = p2;
-            }
+            cached = true;
         }
+        else if(strcmp(argv[1], "--stats") == 0)
+        {
+            stats = &run_stats;
+        }
+        else
+        {
+            session = argv[2];
+            shift = 2;
+        }
+        argv[shift] = argv[0];
+        argv += shift;
+        argc -= shift;
     }
 
-    if(mode == '1')
+    // NOTE the rainbow_stats option of kakoune turns on --stats too, so the script doesn't
+    // need a subshell to add the flag
+    const char *stats_option = getenv("kak_opt_rainbow_stats");
+    if(stats_option && strcmp(stats_option, "true") == 0)
     {
-        if(cursor_range_a.c != 0)
-        {
-            const char *color = "rgb:181818";
-            if(IsRangeVisible(cursor_range_a.pair, cursor_range_b.pair, window_top, window_bottom))
-            {
-                printf("%d.%d,%d.%d|default,%s ",
-                       cursor_range_a.pair.a, cursor_range_a.pair.b,
-                       cursor_range_b.pair.a, cursor_range_b.pair.b, color);
-            }
-        }
+        stats = &run_stats;
+    }
+
+    // NOTE and so does rainbow_latency_budget_ms for --budget, 0 is no budget
+    const char *budget_option = getenv("kak_opt_rainbow_latency_budget_ms");
+    if(budget_option && atoi(budget_option) > 0)
+    {
+        budget_ms = (uint32_t)atoi(budget_option);
+    }
+    LatencyBudget *budget = StartBudget(&run_budget, budget_ms);
+
+    if(argc >= 3 && strcmp(argv[1], "--batch") == 0)
+    {
+        return RunBatch(argc - 2, argv + 2);
+    }
+    else if(argc >= 3 && strcmp(argv[1], "--server") == 0)
+    {
+        return RunServer(argv[2]);
+    }
+    else if(argc >= 3 && strcmp(argv[1], "--stop") == 0)
+    {
+        return SendServerMessage(argv[2], MESSAGE_QUIT, NULL);
+    }
+    else if(argc >= 4 && strcmp(argv[1], "--forget") == 0)
+    {
+        RemoveJobSlot(argv[2], argv[3]);
+        return SendServerMessage(argv[2], MESSAGE_FORGET, argv[3]);
+    }
+    else if(argc >= 3 && strcmp(argv[1], "--histogram") == 0)
+    {
+        return RunHistogram(argv[2]);
+    }
+    else if(argc >= 3 && strcmp(argv[1], "--client") == 0)
+    {
+        // NOTE the socket path takes the place of argv[0]
+        return RunClient(argv[2], argc - 2, argv + 2, map_file, cached, stats, session, budget);
+    }
+
+    // NOTE a mapped file is already all there, it's not streamed
+    SourceStream stream = {};
+    if(streamed && !map_file && StartStream(&stream, STDIN_FILENO, stats))
+    {
+        String source_code = {};
+        int result = RunOnce(argc, argv, &source_code, stats, NULL, session, &stream, budget);
+        Free(&stream);
+        return result;
     }
+    Free(&stream);
 
-    Free(&result);
-    free(source_code.data);
+    uint64_t start = StartPhase(stats);
+    String source_code = LoadSource(argc > 1 ? argv[1] : NULL, map_file);
+    FinishPhase(stats, PHASE_READ, start, source_code.length);
+
+    int result = RunOnce(argc, argv, &source_code, stats, NULL, session, NULL, budget);
+
+    Free(&source_code);
+
+    return result;
 }